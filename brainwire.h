@@ -0,0 +1,3208 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+brainwire - lossless compression of neuralink samples, as a single header 
+library
+
+Do this in *one* C file to create the implementation:
+
+	#define BRAINWIRE_IMPLEMENTATION
+	#include "brainwire.h"
+
+and include "brainwire.h" without the define everywhere else. The rice coder
+and the quantization are static inline in every file that includes this, so 
+they can be inlined into the caller's own loops.
+
+None of the functions exit or print. Functions reading untrusted input 
+return NULL and set brainwire_error; all others return NULL or 0 on failure 
+and set brainwire_error as well.
+
+bwenc.c is the command line tool around this library. The Makefile also 
+builds it as libbrainwire.a and libbrainwire.so.
+
+Options, to be defined together with BRAINWIRE_IMPLEMENTATION:
+	BRAINWIRE_NO_USDT   leave out the USDT probes, which are otherwise compiled
+	                    in if <sys/sdt.h> is available; see "USDT probes"
+	BRAINWIRE_NO_STATS  compile out the statistics collection entirely
+	BRAINWIRE_LATENCY   record the cycles spent on each sample in the encoder
+	                    and decoder loops (x86 only)
+	BRAINWIRE_NO_ENCODER  leave out brainwire_encode() and brainwire_write(),
+	                    for decoder only builds
+	BRAINWIRE_NO_WAV    leave out the WAV reader and writer
+	BRAINWIRE_NO_DISPATCH  compile the sample loops only once, for the build
+	                    target, instead of for each instruction set
+
+The library doesn't use libm. See bwdec.c for a decoder built for size.
+
+On x86, the sample loops are compiled for several instruction sets and the 
+best one is selected at runtime; set BRAINWIRE_ISA=generic|sse4.2|bmi2|avx2|
+avx512 to force one. See "Sample loops" below.
+
+*/
+
+
+/* -----------------------------------------------------------------------------
+	Header - Public functions */
+
+#ifndef BRAINWIRE_H
+#define BRAINWIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+	uint32_t channels;
+	uint32_t samplerate;
+	uint32_t samples;
+} samples_t;
+
+#define BRAINWIRE_FLAG_HUM 0x1
+#define BRAINWIRE_FLAG_WAVELET 0x2
+#define BRAINWIRE_FLAG_SPIKES 0x4
+#define BRAINWIRE_FLAG_FRAMES 0x8
+#define BRAINWIRE_FLAG_TURBO 0x10 // bit-packed instead of rice coded residuals
+
+// The formats of the samples passed to brainwire_encode() and returned by 
+// brainwire_decode(). The encoder takes S16 and CODES only.
+#define BRAINWIRE_FORMAT_S16 0   // 16 bit samples
+#define BRAINWIRE_FORMAT_CODES 1 // the 10 bit codes of brainwire_quant(), as int16
+#define BRAINWIRE_FORMAT_F32 2   // float samples, normalized to -1..1
+#define BRAINWIRE_FORMAT_F16 3   // the same as IEEE half floats, as uint16
+
+// Samples per block of the encoder and decoder sample loops
+#define BRAINWIRE_BLOCK 4096
+
+// The default samples per frame with BRAINWIRE_FLAG_FRAMES
+#define BRAINWIRE_FRAME_LEN (16 * BRAINWIRE_BLOCK)
+
+// The decoder doesn't check bounds for each read, but once per block. For 
+// this, the stream has to be followed by BRAINWIRE_PADDING bytes of 0xff: a
+// rice code then ends at most 1 + 31 bits into the padding, since every bit
+// there terminates the unary part, and a block of residuals (plus spike 
+// template indices of 2 bits) can't read past the padding before the check
+// at the end of the block catches it. The word-wise reader loads 8 bytes
+// at the last position, hence the 8 extra bytes.
+#define BRAINWIRE_PADDING (BRAINWIRE_BLOCK * (32 + 2) / 8 + 8)
+
+typedef struct brainwire_stats_t brainwire_stats_t;
+
+typedef struct {
+	int flags;         // BRAINWIRE_FLAG_*, for encoding
+	int mains_hz;      // 50 or 60, with BRAINWIRE_FLAG_HUM
+	int preview_level; // for decoding progressive streams
+	const char *spikes_path;
+	brainwire_stats_t *stats;
+	int verify;        // decode while encoding and fail if it doesn't match
+	int format;        // BRAINWIRE_FORMAT_* of the samples
+	int frame_len;     // with BRAINWIRE_FLAG_FRAMES, a multiple of 
+	                   // BRAINWIRE_BLOCK; 0 for BRAINWIRE_FRAME_LEN
+} brainwire_opts_t;
+
+// With gcc and clang, the error is kept per thread and the allocation 
+// counters are updated atomically, so that the codec can run on several
+// threads at once
+#if defined(__GNUC__)
+	#define BRAINWIRE_THREAD_LOCAL __thread
+#else
+	#define BRAINWIRE_THREAD_LOCAL
+#endif
+
+// Describes the last error. Readers of untrusted input (wav_read_fh(), 
+// brainwire_decode()) don't abort on malformed data, but return NULL and set
+// this, as do all other functions on failure.
+extern BRAINWIRE_THREAD_LOCAL const char *brainwire_error;
+
+// All memory returned by the functions below has to be released with 
+// brainwire_free()
+void *brainwire_malloc(size_t size);
+void *brainwire_calloc(size_t count, size_t size);
+void *brainwire_realloc(void *ptr, size_t size);
+void brainwire_free(void *ptr);
+
+// Returns the encoded stream, with its length in bytes in out_len, followed by
+// BRAINWIRE_PADDING bytes, so that it can be passed to brainwire_decode(). 
+// With opts->verify, returns NULL if decoding the stream doesn't reproduce 
+// sample_data exactly; brainwire_error names the first sample that differs.
+// BRAINWIRE_FLAG_HUM is dropped from the stream unless it makes it smaller.
+uint8_t *brainwire_encode(short *sample_data, samples_t *desc, brainwire_opts_t *opts, int *out_len);
+
+// Decodes the stream of size bytes, which has to be followed by 
+// BRAINWIRE_PADDING bytes of 0xff. Returns the samples in opts->format, see
+// brainwire_sample_size().
+void *brainwire_decode(uint8_t *bytes, int size, samples_t *desc, brainwire_opts_t *opts);
+
+// Return the number of bytes written, or 0 on failure
+int brainwire_write(const char *path, short *sample_data, samples_t *desc, brainwire_opts_t *opts);
+int wav_write(const char *path, short *sample_data, samples_t *desc);
+
+void *brainwire_read(const char *path, samples_t *desc, brainwire_opts_t *opts);
+short *wav_read(const char *path, samples_t *desc);
+short *wav_read_fh(FILE *fh, samples_t *desc);
+
+// Reads a .bw file into memory, with its size in bytes in size, followed by
+// BRAINWIRE_PADDING bytes of 0xff, as brainwire_decode() requires
+uint8_t *brainwire_load(const char *path, int *size);
+
+// A checkpoint index of a v1 or framed stream: the decoder state before 
+// every interval samples (every frame), so that the stream can be decoded 
+// from any checkpoint on, e.g. in parallel or to seek. It is kept in a 
+// sidecar file next to the stream, see "Checkpoint index".
+typedef struct {
+	uint32_t bit_pos;
+	int32_t prev_quantized;
+	uint32_t rice_k; // the bits of the float
+} brainwire_checkpoint_t;
+
+typedef struct {
+	uint32_t size; // of the stream in bytes
+	uint32_t samples;
+	uint32_t interval;
+	uint32_t count;
+	brainwire_checkpoint_t checkpoints[];
+} brainwire_index_t;
+
+#define BRAINWIRE_INDEX_INTERVAL (16 * BRAINWIRE_BLOCK)
+
+// Builds the index in one pass over the stream of size bytes, followed by
+// BRAINWIRE_PADDING bytes of 0xff. The interval is rounded up to a multiple of
+// BRAINWIRE_BLOCK.
+brainwire_index_t *brainwire_index(uint8_t *bytes, int size, int interval);
+int brainwire_index_write(const char *path, brainwire_index_t *index);
+brainwire_index_t *brainwire_index_read(const char *path);
+
+// Decodes count samples from sample first on into sample_data, starting at
+// the last checkpoint before first. This doesn't allocate memory and can be 
+// called from several threads for the same stream, once the sample loops are
+// selected (see brainwire_kernels_select()). Returns 0 on failure.
+int brainwire_decode_range(uint8_t *bytes, int size, brainwire_index_t *index, int first, int count, short *sample_data);
+
+// A .bw10 file holds the 10 bit codes of brainwire_quant() bit packed, 
+// without entropy coding, for fast staging; see "Packed 10 bit files". 
+// Sample i starts at bit 10 * i after the header, so ranges can be read 
+// without an index.
+#define BRAINWIRE_BW10_HEADER_SIZE 12
+
+// sample_data in opts->format S16 or CODES. Returns the bytes written, or 0.
+int brainwire_bw10_write(const char *path, short *sample_data, samples_t *desc, brainwire_opts_t *opts);
+
+// Returns the samples in opts->format
+void *brainwire_bw10_read(const char *path, samples_t *desc, brainwire_opts_t *opts);
+
+// Decodes count samples from sample first on of the .bw10 file of size bytes,
+// followed by at least 16 bytes (e.g. as read by brainwire_load()), into out
+// in the format. Returns 0 on failure.
+int brainwire_bw10_decode(uint8_t *bytes, int size, samples_t *desc, int first, int count, void *out, int format);
+
+// Selects the sample loops for an instruction set by name (see "Sample 
+// loops"), or the best one supported by the CPU for NULL. Returns 0 if it is
+// unknown or not supported.
+int brainwire_kernels_select(const char *name);
+
+// Statistics of the residuals coded by the sample loops, see "Codec 
+// statistics". With opts->stats set to one of these, brainwire_encode() and
+// brainwire_decode() add to it. brainwire_stats_write() writes them as JSON
+// and returns 0 if the file can't be opened.
+brainwire_stats_t *brainwire_stats_create(void);
+int brainwire_stats_write(brainwire_stats_t *stats, const char *path);
+void brainwire_stats_free(brainwire_stats_t *stats);
+
+/* -----------------------------------------------------------------------------
+	Rice coding and quantization
+
+These are in the innermost loops of the encoder and decoder and static inline
+in every file, so that they can be inlined into the caller's loops, too. */
+
+static inline int rice_read(uint8_t *bytes, int *bit_pos, uint32_t k) {
+	k &= 31; // a corrupt stream can drive the decoder's rice_k arbitrarily high
+	uint32_t msbs = 0;
+	int p = *bit_pos;
+	while (!(bytes[p >> 3] & (1 << (7-(p & 7))))) {
+		p++;
+		msbs++;
+	}
+	p++;
+
+	int count = k;
+	int lsbs = 0;
+	while (count) {
+		int remaining = 8 - (p & 7);
+		int read = remaining < count ? remaining : count;
+		int shift = remaining - read;
+		int mask = (0xff >> (8 - read));
+		lsbs = (lsbs << read) | ((bytes[p >> 3] & (mask << shift)) >> shift);
+		p += read;
+		count -= read;
+	}
+	*bit_pos = p;
+
+	int val;
+	uint32_t uval = (msbs << k) | lsbs;
+	if (uval & 1) {
+		val = -((int)(uval >> 1)) - 1;
+	}
+	else {
+		val = (int)(uval >> 1);
+	}
+
+	return val;
+}
+
+static inline int rice_write(uint8_t *bytes, int *bit_pos, int val, uint32_t k) {
+	uint32_t uval = val;
+	uval <<= 1;
+	uval ^= (val >> 31);
+
+	uint32_t msbs = uval >> k;
+	uint32_t lsbs = 1 + k;
+	uint32_t count = msbs + lsbs;
+	uint32_t pattern = 1 << k; // the unary end bit
+	pattern |= (uval & ((1 << k)-1)); // the binary LSBs
+
+	int pos = *bit_pos;
+	while (count) {
+		int occupied = (pos & 7);
+		int remaining = 8 - occupied;
+		int written = remaining < count ? remaining : count;
+		int bits = 0;
+		if (count - written < 31) {
+			bits = (pattern >> (count - written)) << (remaining - written);
+			bits &= (0xff >> occupied);
+		}
+		bytes[pos >> 3] |= bits;
+		pos += written;
+		count -= written;
+	}
+	*bit_pos = pos;
+	return msbs + lsbs;
+}
+
+/* Word-wise rice coding, for the sample loops
+
+Reads and writes a code with two unaligned 64 bit loads (or one load and
+store) instead of looping over bits and bytes. The stream is big endian, so
+after a byte swap the next bits of the stream are the most significant bits
+of the word. Compiled for BMI2 (see "Sample loops"), the variable shifts 
+become shrx, the masks bzhi and the unary length lzcnt. Both are bit-exact 
+with rice_read() and rice_write(), which bwcheck verifies, but may touch 7
+bytes past the last bit of a code: the decoder's padding and the encoder's
+buffer slack cover this. */
+
+static inline uint64_t rice_load_be64(const uint8_t *p) {
+	#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		return __builtin_bswap64(v);
+	#else
+		uint64_t v = 0;
+		for (int i = 0; i < 8; i++) {
+			v = (v << 8) | p[i];
+		}
+		return v;
+	#endif
+}
+
+static inline void rice_store_be64(uint8_t *p, uint64_t v) {
+	#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		v = __builtin_bswap64(v);
+		memcpy(p, &v, sizeof(v));
+	#else
+		for (int i = 7; i >= 0; i--, v >>= 8) {
+			p[i] = v;
+		}
+	#endif
+}
+
+// Leading zeros of v, which must not be 0
+static inline int rice_clz64(uint64_t v) {
+	#if defined(__GNUC__)
+		return __builtin_clzll(v);
+	#else
+		int n = 0;
+		while (!(v & (1ull << 63))) {
+			v <<= 1;
+			n++;
+		}
+		return n;
+	#endif
+}
+
+static inline int rice_read_word(uint8_t *bytes, int *bit_pos, uint32_t k) {
+	k &= 31;
+	uint32_t msbs = 0;
+	int p = *bit_pos;
+
+	// The low p & 7 bits of the shifted word are zeros shifted in, so if any 
+	// bit is set, the first one is the end of the unary part
+	uint64_t word = rice_load_be64(bytes + (p >> 3)) << (p & 7);
+	while (word == 0) {
+		msbs += 64 - (p & 7);
+		p += 64 - (p & 7);
+		word = rice_load_be64(bytes + (p >> 3)) << (p & 7);
+	}
+	int zeros = rice_clz64(word);
+	msbs += zeros;
+	p += zeros + 1;
+
+	// The k bits after the end bit; for k = 0, the shift by 64 & 63 is 
+	// masked off again
+	uint64_t lsbs = rice_load_be64(bytes + (p >> 3)) >> ((64 - (p & 7) - k) & 63);
+	lsbs &= (1ull << k) - 1;
+	*bit_pos = p + k;
+
+	int val;
+	uint32_t uval = (msbs << k) | (uint32_t)lsbs;
+	if (uval & 1) {
+		val = -((int)(uval >> 1)) - 1;
+	}
+	else {
+		val = (int)(uval >> 1);
+	}
+
+	return val;
+}
+
+static inline int rice_write_word(uint8_t *bytes, int *bit_pos, int val, uint32_t k) {
+	uint32_t uval = val;
+	uval <<= 1;
+	uval ^= (val >> 31);
+
+	uint32_t msbs = uval >> k;
+	uint32_t lsbs = 1 + k;
+	uint64_t pattern = 1ull << k; // the unary end bit
+	pattern |= (uval & ((1ull << k)-1)); // the binary LSBs
+
+	// The unary zeros are already there in the zeroed buffer, so only the
+	// k + 1 bits of the pattern (at most 7 + 32 with the offset) are written
+	int pos = *bit_pos + msbs;
+	uint8_t *p = bytes + (pos >> 3);
+	rice_store_be64(p, rice_load_be64(p) | (pattern << (64 - (pos & 7) - lsbs)));
+	*bit_pos = pos + lsbs;
+	return msbs + lsbs;
+}
+
+
+static inline int brainwire_dequant(int v) {
+	// Not really sure what's goin on here. The original 10bit data was 
+	// upscaled to 16 bit somehow. It wasn't a simple bit shift. This thing
+	// here was found through a brute force search and just happens to 
+	// replicate neuralink's original upscale.
+	// The (int) casts of these positive values + 0.5 are round(), but don't
+	// need libm; bwcheck verifies this for all 16 bit values.
+	if (v >= 0) {
+		return (int)(v * 64.061577 + 31.034184 + 0.5);
+	}
+	else {
+		return -(int)((-v -1) * 64.061577 + 31.034184 + 0.5) - 1;
+	}
+}
+
+static inline int brainwire_quant(int v) {
+	// Same as floor(v/64.0) for all 16 bit values, but integer only. This
+	// relies on >> being an arithmetic shift for negative values.
+	return v >> 6;
+}
+
+// The bytes per sample of a BRAINWIRE_FORMAT_*, or 0 if it is unknown
+static inline int brainwire_sample_size(int format) {
+	switch (format) {
+		case BRAINWIRE_FORMAT_S16: 
+		case BRAINWIRE_FORMAT_CODES: 
+		case BRAINWIRE_FORMAT_F16: return 2;
+		case BRAINWIRE_FORMAT_F32: return 4;
+		default: return 0;
+	}
+}
+
+static inline float brainwire_f32(int v) {
+	return v * (1.0f / 32768);
+}
+
+// The half float of brainwire_f32(v) for a 16 bit sample, rounded to nearest
+// even as with F16C's vcvtps2ph. Branch free and integer only after the 
+// conversion to float, so that the decoder's loops vectorize without F16C; 
+// bwcheck verifies this for all 16 bit values.
+static inline uint16_t brainwire_f16(int v) {
+	union { float f; uint32_t u; } x = {brainwire_f32(v)};
+	uint32_t sign = x.u & 0x80000000;
+	x.u ^= sign;
+
+	// Below 2^-14 the half is subnormal: adding 0.5 rounds the mantissa into
+	// the lowest bits. Otherwise, rebias the exponent and round the mantissa.
+	union { float f; uint32_t u; } subnormal = {x.f + 0.5f};
+	uint32_t half = x.u < (113u << 23)
+		? subnormal.u - 0x3f000000
+		: (x.u - (112u << 23) + 0xfff + ((x.u >> 13) & 1)) >> 13;
+	return half | (sign >> 16);
+}
+
+#endif // BRAINWIRE_H
+
+
+
+/* -----------------------------------------------------------------------------
+	Implementation */
+
+#ifdef BRAINWIRE_IMPLEMENTATION
+
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
+
+BRAINWIRE_THREAD_LOCAL const char *brainwire_error = "";
+
+#define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
+
+static void brainwire_put_u32(uint8_t *p, uint32_t v) {
+	p[0] = 0xff & (v      );
+	p[1] = 0xff & (v >>  8);
+	p[2] = 0xff & (v >> 16);
+	p[3] = 0xff & (v >> 24);
+}
+
+static uint32_t brainwire_get_u32(uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Pipeline stages. If brainwire_perf_hook is set, it is called at the begin
+// and end of each stage, per block for the per-sample stages.
+enum {
+	BRAINWIRE_PERF_PARSE,
+	BRAINWIRE_PERF_QUANT,
+	BRAINWIRE_PERF_ENTROPY,
+	BRAINWIRE_PERF_DEQUANT,
+	BRAINWIRE_PERF_WRITE,
+	BRAINWIRE_PERF_STAGES
+};
+
+static void (*brainwire_perf_hook)(int stage, int begin) = NULL;
+
+#define BRAINWIRE_PERF_BEGIN(STAGE) if (brainwire_perf_hook) { brainwire_perf_hook(STAGE, 1); }
+#define BRAINWIRE_PERF_END(STAGE) if (brainwire_perf_hook) { brainwire_perf_hook(STAGE, 0); }
+
+
+/* Allocation tracking, for --mem-report. All allocations of the codec go 
+through these wrappers, which prefix each block with its size. Memory 
+returned by the codec must be released with brainwire_free(). */
+
+#define BRAINWIRE_MEM_HEADER 16 // keeps the returned pointers 16 byte aligned
+
+typedef struct {
+	uint64_t current;
+	uint64_t peak;
+	uint64_t total;
+} brainwire_mem_t;
+
+static brainwire_mem_t brainwire_mem;
+
+// The peak is only approximate with several threads
+#if defined(__GNUC__)
+	#define BRAINWIRE_MEM_ADD(FIELD, V) __atomic_add_fetch(&brainwire_mem.FIELD, (V), __ATOMIC_RELAXED)
+#else
+	#define BRAINWIRE_MEM_ADD(FIELD, V) (brainwire_mem.FIELD += (V))
+#endif
+
+void *brainwire_malloc(size_t size) {
+	uint8_t *p = malloc(size + BRAINWIRE_MEM_HEADER);
+	if (!p) {
+		return NULL;
+	}
+	*(size_t *)p = size;
+	uint64_t current = BRAINWIRE_MEM_ADD(current, size);
+	BRAINWIRE_MEM_ADD(total, size);
+	if (current > brainwire_mem.peak) {
+		brainwire_mem.peak = current;
+	}
+	return p + BRAINWIRE_MEM_HEADER;
+}
+
+void *brainwire_calloc(size_t count, size_t size) {
+	void *p = brainwire_malloc(count * size);
+	if (p) {
+		memset(p, 0, count * size);
+	}
+	return p;
+}
+
+void brainwire_free(void *ptr) {
+	if (!ptr) {
+		return;
+	}
+	uint8_t *p = (uint8_t *)ptr - BRAINWIRE_MEM_HEADER;
+	BRAINWIRE_MEM_ADD(current, -(uint64_t)*(size_t *)p);
+	free(p);
+}
+
+void *brainwire_realloc(void *ptr, size_t size) {
+	if (!ptr) {
+		return brainwire_malloc(size);
+	}
+	size_t old_size = *(size_t *)((uint8_t *)ptr - BRAINWIRE_MEM_HEADER);
+
+	// Shrinking is done in place, without a second block for the copy
+	if (size <= old_size) {
+		uint8_t *p = realloc((uint8_t *)ptr - BRAINWIRE_MEM_HEADER, size + BRAINWIRE_MEM_HEADER);
+		if (!p) {
+			return NULL;
+		}
+		*(size_t *)p = size;
+		BRAINWIRE_MEM_ADD(current, -(uint64_t)(old_size - size));
+		return p + BRAINWIRE_MEM_HEADER;
+	}
+	void *p = brainwire_malloc(size);
+	if (p) {
+		memcpy(p, ptr, old_size);
+		brainwire_free(ptr);
+	}
+	return p;
+}
+
+#ifndef BRAINWIRE_NO_ENCODER
+
+// The encoder writes into a zeroed buffer of *size bytes, followed by
+// BRAINWIRE_PADDING bytes of 0xff like the decoder expects. This grows it to
+// at least len bytes, by at least half its size. Returns 0 if that fails; 
+// the old buffer is left as it was then.
+static int brainwire_reserve(uint8_t **bytes, int *size, int64_t len) {
+	if (len <= *size) {
+		return 1;
+	}
+	int64_t new_size = *size + *size / 2 > len ? *size + *size / 2 : len;
+	if (new_size > INT32_MAX - BRAINWIRE_PADDING) {
+		new_size = INT32_MAX - BRAINWIRE_PADDING;
+	}
+	if (len > new_size) {
+		brainwire_error = "Stream too large";
+		return 0;
+	}
+	uint8_t *p = brainwire_realloc(*bytes, new_size + BRAINWIRE_PADDING);
+	if (!p) {
+		brainwire_error = "Malloc failed";
+		return 0;
+	}
+	memset(p + *size, 0, new_size - *size);
+	memset(p + new_size, 0xff, BRAINWIRE_PADDING);
+	*bytes = p;
+	*size = new_size;
+	return 1;
+}
+
+#endif // BRAINWIRE_NO_ENCODER
+
+
+/* -----------------------------------------------------------------------------
+	WAV reader / writer */
+
+#ifndef BRAINWIRE_NO_WAV
+
+#define WAV_CHUNK_ID(S) \
+	(((uint32_t)(S[3])) << 24 | ((uint32_t)(S[2])) << 16 | \
+	 ((uint32_t)(S[1])) <<  8 | ((uint32_t)(S[0])))
+
+// Return 0 on a write error
+static int fwrite_u32_le(uint32_t v, FILE *fh) {
+	uint8_t buf[sizeof(uint32_t)];
+	buf[0] = 0xff & (v      );
+	buf[1] = 0xff & (v >>  8);
+	buf[2] = 0xff & (v >> 16);
+	buf[3] = 0xff & (v >> 24);
+	return fwrite(buf, sizeof(uint32_t), 1, fh);
+}
+
+static int fwrite_u16_le(unsigned short v, FILE *fh) {
+	uint8_t buf[sizeof(unsigned short)];
+	buf[0] = 0xff & (v      );
+	buf[1] = 0xff & (v >>  8);
+	return fwrite(buf, sizeof(unsigned short), 1, fh);
+}
+
+// Return 0 at the end of the file; the caller has to check feof()
+static uint32_t fread_u32_le(FILE *fh) {
+	uint8_t buf[sizeof(uint32_t)] = {0};
+	if (!fread(buf, sizeof(uint32_t), 1, fh)) {
+		return 0;
+	}
+	return ((uint32_t)buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+}
+
+static unsigned short fread_u16_le(FILE *fh) {
+	uint8_t buf[sizeof(unsigned short)] = {0};
+	if (!fread(buf, sizeof(unsigned short), 1, fh)) {
+		return 0;
+	}
+	return (buf[1] << 8) | buf[0];
+}
+
+// Returns 0 on a write error
+static int wav_write_header(FILE *fh, samples_t *desc) {
+	uint32_t data_size = desc->samples * desc->channels * sizeof(short);
+	uint32_t samplerate = desc->samplerate;
+	short bits_per_sample = 16;
+	short channels = desc->channels;
+
+	// Lifted from https://www.jonolick.com/code.html - public domain
+	// Made endian agnostic using fwrite_u*()
+	int ok = fwrite("RIFF", 1, 4, fh) == 4;
+	ok &= fwrite_u32_le(data_size + 44 - 8, fh);
+	ok &= fwrite("WAVEfmt \x10\x00\x00\x00\x01\x00", 1, 14, fh) == 14;
+	ok &= fwrite_u16_le(channels, fh);
+	ok &= fwrite_u32_le(samplerate, fh);
+	ok &= fwrite_u32_le(channels * samplerate * bits_per_sample/8, fh);
+	ok &= fwrite_u16_le(channels * bits_per_sample/8, fh);
+	ok &= fwrite_u16_le(bits_per_sample, fh);
+	ok &= fwrite("data", 1, 4, fh) == 4;
+	ok &= fwrite_u32_le(data_size, fh);
+	return ok;
+}
+
+int wav_write(const char *path, short *sample_data, samples_t *desc) {
+	uint32_t data_size = desc->samples * desc->channels * sizeof(short);
+
+	BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_WRITE);
+	FILE *fh = fopen(path, "wb");
+	if (!fh) {
+		brainwire_error = "Can't open file for writing";
+		return 0;
+	}
+	int ok = wav_write_header(fh, desc);
+	ok &= data_size == 0 || fwrite((void*)sample_data, data_size, 1, fh);
+	ok &= fclose(fh) == 0;
+	BRAINWIRE_PERF_END(BRAINWIRE_PERF_WRITE);
+	if (!ok) {
+		brainwire_error = "Write error";
+		return 0;
+	}
+	return data_size  + 44 - 8;
+}
+
+#define WAV_CHECK(TEST, MSG) \
+	if (!(TEST)) { \
+		brainwire_error = MSG; \
+		return NULL; \
+	}
+
+// Returns NULL and sets brainwire_error if the file is malformed
+short *wav_read_fh(FILE *fh, samples_t *desc) {
+	uint32_t container_type = fread_u32_le(fh);
+	WAV_CHECK(container_type == WAV_CHUNK_ID("RIFF"), "Not a RIFF container");
+
+	fread_u32_le(fh); // the RIFF size, not needed
+	uint32_t wavid = fread_u32_le(fh);
+	WAV_CHECK(wavid == WAV_CHUNK_ID("WAVE"), "No WAVE id found");
+
+	uint32_t data_size = 0;
+	uint32_t format_type = 0;
+	uint32_t channels = 0;
+	uint32_t samplerate = 0;
+	uint32_t bits_per_sample = 0;
+
+	// Find the fmt and data chunk, skip all others
+	while (1) {
+		uint32_t chunk_type = fread_u32_le(fh);
+		uint32_t chunk_size = fread_u32_le(fh);
+		WAV_CHECK(!feof(fh), "No data chunk");
+
+		if (chunk_type == WAV_CHUNK_ID("fmt ")) {
+			WAV_CHECK(chunk_size == 16 || chunk_size == 18, "WAV fmt chunk size missmatch");
+
+			format_type = fread_u16_le(fh);
+			channels = fread_u16_le(fh);
+			samplerate = fread_u32_le(fh);
+			fread_u32_le(fh); // byte rate
+			fread_u16_le(fh); // block align
+			bits_per_sample = fread_u16_le(fh);
+
+			if (chunk_size == 18) {
+				unsigned short extra_params = fread_u16_le(fh);
+				WAV_CHECK(extra_params == 0, "WAV fmt extra params not supported");
+			}
+		}
+		else if (chunk_type == WAV_CHUNK_ID("data")) {
+			data_size = chunk_size;
+			break;
+		}
+		else {
+			int seek_result = fseek(fh, chunk_size, SEEK_CUR);
+			WAV_CHECK(seek_result == 0, "Malformed RIFF header");
+		}
+	}
+
+	WAV_CHECK(format_type == 1, "Type in fmt chunk is not PCM");
+	WAV_CHECK(bits_per_sample == 16, "Bits per samples != 16");
+	WAV_CHECK(channels > 0, "No channels");
+	WAV_CHECK(data_size, "No data chunk");
+
+	// Don't trust the data size before allocating
+	long data_start = ftell(fh);
+	fseek(fh, 0, SEEK_END);
+	long file_end = ftell(fh);
+	fseek(fh, data_start, SEEK_SET);
+	WAV_CHECK(data_start >= 0 && file_end - data_start >= data_size, "Unexpected end of file");
+
+	uint8_t *wav_bytes = brainwire_malloc(data_size);
+	WAV_CHECK(wav_bytes, "Malloc failed");
+	if (!fread(wav_bytes, data_size, 1, fh)) {
+		brainwire_free(wav_bytes);
+		WAV_CHECK(0, "Read error or unexpected end of file");
+	}
+
+	desc->samplerate = samplerate;
+	desc->samples = data_size / (channels * (bits_per_sample/8));
+	desc->channels = channels;
+	return (short*)wav_bytes;
+}
+
+short *wav_read(const char *path, samples_t *desc) {
+	BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_PARSE);
+	FILE *fh = fopen(path, "rb");
+	if (!fh) {
+		brainwire_error = "Can't open file for reading";
+		return NULL;
+	}
+	short *sample_data = wav_read_fh(fh, desc);
+	fclose(fh);
+	BRAINWIRE_PERF_END(BRAINWIRE_PERF_PARSE);
+	return sample_data;
+}
+
+#endif // BRAINWIRE_NO_WAV
+
+
+
+/* -----------------------------------------------------------------------------
+	BRAINWIRE reader / writer
+
+The original (v1) stream has no header beyond the sample count and samplerate.
+A v2 stream starts with a sample count of 0, which a v1 decoder reads as an
+empty file, followed by a magic, the version and feature flags. Only streams
+that use one of the v2 features are written as v2.
+
+With BRAINWIRE_FLAG_FRAMES, the header ends with the frame length, followed
+by the byte aligned frame table: the byte offset of each frame as u32, 
+little endian. Each frame starts byte aligned with a fresh coder state 
+(rice_k 3, prev_quantized 0, hum predictor and spike templates reset), so
+that it can be decoded on its own.
+
+With BRAINWIRE_FLAG_TURBO, the samples (of each frame) are byte aligned 
+turbo blocks instead of rice codes, see "Turbo blocks". */
+
+#define BRAINWIRE_MAGIC 0x4257 // "BW"
+#define BRAINWIRE_VERSION 2
+
+// Stores the quantized value q as sample i of out, in the BRAINWIRE_FORMAT_*.
+// The decoder's sample loops reconstruct whole blocks with 
+// brainwire_reconstruct() instead.
+static void brainwire_put_sample(void *out, int i, int q, int format) {
+	short v = brainwire_dequant(q);
+	switch (format) {
+		case BRAINWIRE_FORMAT_CODES: ((short *)out)[i] = q; break;
+		case BRAINWIRE_FORMAT_F32: ((float *)out)[i] = brainwire_f32(v); break;
+		case BRAINWIRE_FORMAT_F16: ((uint16_t *)out)[i] = brainwire_f16(v); break;
+		default: ((short *)out)[i] = v; break;
+	}
+}
+
+
+/* Codec statistics. If opts->stats is set, each residual coded in the sample 
+loops of brainwire_encode() and brainwire_decode() is recorded. This costs a
+well predicted branch per sample when disabled, and a few increments of small
+arrays when enabled. Bits are summed per BRAINWIRE_STATS_BLOCK samples; the
+sliding windows of BRAINWIRE_STATS_WINDOW samples are only computed from 
+these when writing the report. With BRAINWIRE_NO_STATS defined, nothing is
+compiled into the loops at all. */
+
+#define BRAINWIRE_STATS_RESIDUAL_MAX 1024
+#define BRAINWIRE_STATS_BLOCK 256
+#define BRAINWIRE_STATS_WINDOW 4096
+
+struct brainwire_stats_t {
+	uint64_t samples;
+	uint64_t residuals[2 * BRAINWIRE_STATS_RESIDUAL_MAX + 1];
+	uint64_t k[32];
+	uint64_t unary_bits;
+	uint64_t binary_bits;
+	uint32_t *block_bits;
+	int block_bits_len;
+	int block_bits_cap;
+	uint32_t current_block_bits;
+};
+
+#ifdef BRAINWIRE_NO_STATS
+	#define BRAINWIRE_STATS_RECORD(STATS, RESIDUAL, K, LEN)
+#else
+	#define BRAINWIRE_STATS_RECORD(STATS, RESIDUAL, K, LEN) \
+		if (STATS) { brainwire_stats_record(STATS, RESIDUAL, K, LEN); }
+#endif
+
+// If growing the block list fails, the block is dropped from the sliding
+// windows, but still counted in the totals
+static void brainwire_stats_push_block(brainwire_stats_t *stats) {
+	if (stats->block_bits_len == stats->block_bits_cap) {
+		int cap = stats->block_bits_cap ? stats->block_bits_cap * 2 : 1024;
+		uint32_t *block_bits = brainwire_realloc(stats->block_bits, cap * sizeof(uint32_t));
+		if (!block_bits) {
+			stats->current_block_bits = 0;
+			return;
+		}
+		stats->block_bits = block_bits;
+		stats->block_bits_cap = cap;
+	}
+	stats->block_bits[stats->block_bits_len++] = stats->current_block_bits;
+	stats->current_block_bits = 0;
+}
+
+static inline void brainwire_stats_record(brainwire_stats_t *stats, int residual, int k, int encoded_len) {
+	int r = residual;
+	if (r > BRAINWIRE_STATS_RESIDUAL_MAX) { r = BRAINWIRE_STATS_RESIDUAL_MAX; }
+	if (r < -BRAINWIRE_STATS_RESIDUAL_MAX) { r = -BRAINWIRE_STATS_RESIDUAL_MAX; }
+	stats->residuals[r + BRAINWIRE_STATS_RESIDUAL_MAX]++;
+	stats->k[k & 31]++;
+	stats->unary_bits += encoded_len - k;
+	stats->binary_bits += k;
+	stats->current_block_bits += encoded_len;
+	if (++stats->samples % BRAINWIRE_STATS_BLOCK == 0) {
+		brainwire_stats_push_block(stats);
+	}
+}
+
+brainwire_stats_t *brainwire_stats_create(void) {
+	brainwire_stats_t *stats = brainwire_calloc(1, sizeof(brainwire_stats_t));
+	if (!stats) {
+		brainwire_error = "Malloc failed";
+	}
+	return stats;
+}
+
+void brainwire_stats_free(brainwire_stats_t *stats) {
+	if (stats) {
+		brainwire_free(stats->block_bits);
+		brainwire_free(stats);
+	}
+}
+
+int brainwire_stats_write(brainwire_stats_t *stats, const char *path) {
+	FILE *fh = fopen(path, "w");
+	if (!fh) {
+		brainwire_error = "Can't open file for writing";
+		return 0;
+	}
+
+	uint64_t bits = stats->unary_bits + stats->binary_bits;
+	fprintf(fh, "{\n  \"samples\": %llu,\n", (unsigned long long)stats->samples);
+	fprintf(
+		fh, "  \"unary_bits\": %llu,\n  \"binary_bits\": %llu,\n  \"bits_per_sample\": %.4f,\n",
+		(unsigned long long)stats->unary_bits, (unsigned long long)stats->binary_bits,
+		stats->samples ? (double)bits / stats->samples : 0.0
+	);
+
+	// Residuals at the edges of the histogram are clamped
+	fprintf(fh, "  \"residual_histogram\": {");
+	int first = 1;
+	for (int i = 0; i < 2 * BRAINWIRE_STATS_RESIDUAL_MAX + 1; i++) {
+		if (stats->residuals[i]) {
+			fprintf(
+				fh, "%s\"%d\": %llu", first ? "" : ", ", 
+				i - BRAINWIRE_STATS_RESIDUAL_MAX, (unsigned long long)stats->residuals[i]
+			);
+			first = 0;
+		}
+	}
+	fprintf(fh, "},\n  \"k_histogram\": {");
+	first = 1;
+	for (int i = 0; i < 32; i++) {
+		if (stats->k[i]) {
+			fprintf(fh, "%s\"%d\": %llu", first ? "" : ", ", i, (unsigned long long)stats->k[i]);
+			first = 0;
+		}
+	}
+
+	// Sliding windows, advancing by one block. A trailing partial block is 
+	// only included if there's no complete window.
+	int window_blocks = BRAINWIRE_STATS_WINDOW / BRAINWIRE_STATS_BLOCK;
+	fprintf(
+		fh, "},\n  \"window\": %d,\n  \"window_hop\": %d,\n  \"window_bits_per_sample\": [", 
+		BRAINWIRE_STATS_WINDOW, BRAINWIRE_STATS_BLOCK
+	);
+	if (stats->block_bits_len < window_blocks) {
+		if (stats->samples) {
+			fprintf(fh, "%.4f", (double)bits / stats->samples);
+		}
+	}
+	else {
+		uint64_t sum = 0;
+		for (int i = 0; i < stats->block_bits_len; i++) {
+			sum += stats->block_bits[i];
+			if (i >= window_blocks) {
+				sum -= stats->block_bits[i - window_blocks];
+			}
+			if (i >= window_blocks - 1) {
+				fprintf(
+					fh, "%s%.4f", i >= window_blocks ? ", " : "", 
+					(double)sum / BRAINWIRE_STATS_WINDOW
+				);
+			}
+		}
+	}
+	fprintf(fh, "]\n}\n");
+	fclose(fh);
+	return 1;
+}
+
+
+/* USDT probes for bpftrace & co, under the "brainwire" provider:
+
+	file_open(path, is_write)       entering brainwire_read/brainwire_write
+	file_close(path, bytes)         leaving them, with the stream size
+	block(sample, bit_pos, rice_k)  every BRAINWIRE_PROBE_BLOCK samples in the
+	                                sample loops; at each band in progressive 
+	                                mode, with the band as sample
+	k_change(sample, old_k, new_k)  the integer rice_k moved by at least 
+	                                BRAINWIRE_PROBE_K_DELTA since the last probe
+	escape(sample, residual, len)   a codeword with at least 
+	                                BRAINWIRE_PROBE_ESCAPE_LEN unary bits
+
+e.g. bpftrace -e 'usdt:./bwenc:brainwire:escape { @[arg2] = count(); }'
+
+An unattached probe is a single nop. The checks for the block, k_change and 
+escape conditions are a few well predicted compares per sample; they are 
+only compiled in together with the probes. */
+
+#if !defined(BRAINWIRE_NO_USDT) && defined(__has_include)
+	#if __has_include(<sys/sdt.h>)
+		#include <sys/sdt.h>
+		#define BRAINWIRE_USDT
+	#endif
+#endif
+
+#define BRAINWIRE_PROBE_BLOCK 4096
+#define BRAINWIRE_PROBE_K_DELTA 2
+#define BRAINWIRE_PROBE_ESCAPE_LEN 16
+
+#ifdef BRAINWIRE_USDT
+	#define BRAINWIRE_PROBE2(NAME, A, B) DTRACE_PROBE2(brainwire, NAME, A, B)
+	#define BRAINWIRE_PROBE3(NAME, A, B, C) DTRACE_PROBE3(brainwire, NAME, A, B, C)
+	#define BRAINWIRE_PROBE_SAMPLE(SAMPLE, BIT_POS, K, PROBE_K, RESIDUAL, LEN) \
+		if (((SAMPLE) & (BRAINWIRE_PROBE_BLOCK - 1)) == 0) { \
+			BRAINWIRE_PROBE3(block, SAMPLE, BIT_POS, K); \
+		} \
+		if ((K) - (PROBE_K) >= BRAINWIRE_PROBE_K_DELTA || (PROBE_K) - (K) >= BRAINWIRE_PROBE_K_DELTA) { \
+			BRAINWIRE_PROBE3(k_change, SAMPLE, PROBE_K, K); \
+			PROBE_K = K; \
+		} \
+		if ((LEN) - (K) > BRAINWIRE_PROBE_ESCAPE_LEN) { \
+			BRAINWIRE_PROBE3(escape, SAMPLE, RESIDUAL, LEN); \
+		}
+#else
+	#define BRAINWIRE_PROBE2(NAME, A, B)
+	#define BRAINWIRE_PROBE3(NAME, A, B, C)
+	#define BRAINWIRE_PROBE_SAMPLE(SAMPLE, BIT_POS, K, PROBE_K, RESIDUAL, LEN)
+#endif
+
+
+/* Latency instrumentation. With BRAINWIRE_LATENCY defined, the rdtsc cycles
+of each iteration of the encoder and decoder sample loops are recorded into 
+log-linear (HDR style) histograms: values below 2^BRAINWIRE_LATENCY_SUB_BITS
+are exact, above that each power of two is split into 
+2^BRAINWIRE_LATENCY_SUB_BITS buckets, i.e. < 3% error. The timestamps are not
+serializing, so very short samples are somewhat smeared into their 
+neighbours; the tail, which is what we care about, is accurate. Without 
+BRAINWIRE_LATENCY the macros compile to nothing. */
+
+#define BRAINWIRE_LATENCY_SUB_BITS 5
+#define BRAINWIRE_LATENCY_BUCKETS (64 << BRAINWIRE_LATENCY_SUB_BITS)
+
+typedef struct {
+	uint64_t counts[BRAINWIRE_LATENCY_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} brainwire_latency_t;
+
+enum {
+	BRAINWIRE_LATENCY_ENCODE,
+	BRAINWIRE_LATENCY_DECODE
+};
+
+#ifdef BRAINWIRE_LATENCY
+	#if !defined(__x86_64__) && !defined(__i386__)
+		#error "BRAINWIRE_LATENCY requires rdtsc (x86)"
+	#endif
+	#include <x86intrin.h>
+
+	static brainwire_latency_t brainwire_latency[2];
+
+	#define BRAINWIRE_LATENCY_BEGIN() uint64_t latency_start = __rdtsc()
+	#define BRAINWIRE_LATENCY_END(WHICH) \
+		brainwire_latency_record(&brainwire_latency[WHICH], __rdtsc() - latency_start)
+#else
+	#define BRAINWIRE_LATENCY_BEGIN()
+	#define BRAINWIRE_LATENCY_END(WHICH)
+#endif
+
+static inline int brainwire_latency_bucket(uint64_t v) {
+	if (v < (1 << BRAINWIRE_LATENCY_SUB_BITS)) {
+		return v;
+	}
+	int shift = 63 - __builtin_clzll(v) - BRAINWIRE_LATENCY_SUB_BITS;
+	return ((shift + 1) << BRAINWIRE_LATENCY_SUB_BITS) + 
+		(int)(v >> shift) - (1 << BRAINWIRE_LATENCY_SUB_BITS);
+}
+
+static inline uint64_t brainwire_latency_bucket_value(int bucket) {
+	if (bucket < (1 << BRAINWIRE_LATENCY_SUB_BITS)) {
+		return bucket;
+	}
+	int shift = (bucket >> BRAINWIRE_LATENCY_SUB_BITS) - 1;
+	uint64_t sub = (bucket & ((1 << BRAINWIRE_LATENCY_SUB_BITS) - 1)) + (1 << BRAINWIRE_LATENCY_SUB_BITS);
+	return sub << shift;
+}
+
+static inline void brainwire_latency_record(brainwire_latency_t *lat, uint64_t cycles) {
+	lat->counts[brainwire_latency_bucket(cycles)]++;
+	lat->total++;
+	if (cycles > lat->max) {
+		lat->max = cycles;
+	}
+}
+
+// Returns the lower bound of the bucket containing the given percentile
+static inline uint64_t brainwire_latency_percentile(brainwire_latency_t *lat, double percentile) {
+	uint64_t rank = (uint64_t)(lat->total * percentile / 100.0);
+	uint64_t seen = 0;
+	for (int i = 0; i < BRAINWIRE_LATENCY_BUCKETS; i++) {
+		seen += lat->counts[i];
+		if (seen > rank) {
+			return brainwire_latency_bucket_value(i);
+		}
+	}
+	return lat->max;
+}
+
+/* Mains hum predictor. A 32 bit phase accumulator tracks the (generally 
+non-integer) mains period at the stream samplerate. For each of the 
+BRAINWIRE_HUM_BINS phase bins we keep a running average of the difference to
+the previous sample. Since the rest of the signal averages out over many 
+periods, this converges to the periodic component of the difference, which is
+subtracted from it before rice coding. Working on the differences, rather
+than on the signal itself, keeps strong low frequency content out of the 
+estimates. Everything is integer and only uses already coded samples, so the
+decoder can replicate it exactly and there's no added delay. */
+
+#define BRAINWIRE_HUM_BINS_LOG2 9
+#define BRAINWIRE_HUM_BINS (1 << BRAINWIRE_HUM_BINS_LOG2)
+#define BRAINWIRE_HUM_SCALE 8 // fixed point bits of the estimates
+#define BRAINWIRE_HUM_RATE 6  // adaption speed of a bin, as a shift
+
+typedef struct {
+	uint32_t phase;
+	uint32_t phase_inc;
+	int bins[BRAINWIRE_HUM_BINS];
+} brainwire_hum_t;
+
+static void brainwire_hum_init(brainwire_hum_t *hum, int mains_hz, int samplerate) {
+	memset(hum, 0, sizeof(brainwire_hum_t));
+	hum->phase_inc = (uint32_t)(((uint64_t)mains_hz << 32) / samplerate);
+}
+
+static inline int brainwire_hum_predict(brainwire_hum_t *hum) {
+	int bin = hum->phase >> (32 - BRAINWIRE_HUM_BINS_LOG2);
+	int est = hum->bins[bin];
+	return (est + (1 << (BRAINWIRE_HUM_SCALE - 1))) >> BRAINWIRE_HUM_SCALE;
+}
+
+static inline void brainwire_hum_update(brainwire_hum_t *hum, int diff) {
+	int bin = hum->phase >> (32 - BRAINWIRE_HUM_BINS_LOG2);
+	int v = diff * (1 << BRAINWIRE_HUM_SCALE);
+	hum->bins[bin] += (v - hum->bins[bin]) >> BRAINWIRE_HUM_RATE;
+	hum->phase += hum->phase_inc;
+}
+
+
+
+/* Spike templates. A spike event is triggered on both sides when the unary
+part of a residual (with the current rice_k) exceeds 
+BRAINWIRE_SPIKE_THRESHOLD. The encoder then looks ahead at the next
+BRAINWIRE_SPIKE_LEN residuals, finds the closest template in the dictionary 
+and writes its index + 1 (or 0 for none). For the duration of the event, the
+template is subtracted from the residuals before rice coding.
+
+Once an event is complete, the decoder has the same residuals as the encoder
+and both update the dictionary: a used template is moved towards the actual 
+waveform, otherwise the waveform is added as a new template. The dictionary
+is kept in most-recently-used order, so frequent templates have low indices.
+This adds BRAINWIRE_SPIKE_LEN samples of delay to the encoder only. */
+
+#define BRAINWIRE_SPIKE_LEN 32
+#define BRAINWIRE_SPIKE_TEMPLATES 16
+#define BRAINWIRE_SPIKE_THRESHOLD 4
+#define BRAINWIRE_SPIKE_CLAMP 8191
+
+typedef struct {
+	int16_t templates[BRAINWIRE_SPIKE_TEMPLATES][BRAINWIRE_SPIKE_LEN];
+	int16_t window[BRAINWIRE_SPIKE_LEN];
+	int num_templates;
+	int index;  // template of the current event, -1 for none
+	int pos;    // position in the current event, -1 outside of an event
+} brainwire_spikes_t;
+
+static void brainwire_spikes_init(brainwire_spikes_t *spikes) {
+	memset(spikes, 0, sizeof(brainwire_spikes_t));
+	spikes->index = -1;
+	spikes->pos = -1;
+}
+
+static inline int16_t brainwire_spikes_clamp(int v) {
+	if (v > BRAINWIRE_SPIKE_CLAMP) { return BRAINWIRE_SPIKE_CLAMP; }
+	if (v < -BRAINWIRE_SPIKE_CLAMP) { return -BRAINWIRE_SPIKE_CLAMP; }
+	return v;
+}
+
+#ifndef BRAINWIRE_NO_ENCODER
+
+static inline int brainwire_spikes_sad(const int16_t *a, const int16_t *b) {
+	#if defined(__SSE2__)
+		__m128i zero = _mm_setzero_si128();
+		__m128i ones = _mm_set1_epi16(1);
+		__m128i sum = zero;
+		for (int i = 0; i < BRAINWIRE_SPIKE_LEN; i += 8) {
+			__m128i d = _mm_sub_epi16(
+				_mm_loadu_si128((const __m128i *)(a + i)), 
+				_mm_loadu_si128((const __m128i *)(b + i))
+			);
+			d = _mm_max_epi16(d, _mm_sub_epi16(zero, d));
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(d, ones));
+		}
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtsi128_si32(sum);
+	#else
+		int sum = 0;
+		for (int i = 0; i < BRAINWIRE_SPIKE_LEN; i++) {
+			int d = a[i] - b[i];
+			sum += d < 0 ? -d : d;
+		}
+		return sum;
+	#endif
+}
+
+// Encoder only: find the best template for the upcoming residuals; returns
+// -1 if none is better than coding the residuals as they are
+static int brainwire_spikes_match(brainwire_spikes_t *spikes, const int16_t *upcoming) {
+	static const int16_t zero[BRAINWIRE_SPIKE_LEN] = {0};
+	int best_index = -1;
+	int best_sad = brainwire_spikes_sad(upcoming, zero) - BRAINWIRE_SPIKE_LEN / 2;
+	for (int i = 0; i < spikes->num_templates; i++) {
+		int sad = brainwire_spikes_sad(upcoming, spikes->templates[i]);
+		if (sad < best_sad) {
+			best_sad = sad;
+			best_index = i;
+		}
+	}
+	return best_index;
+}
+
+#endif // BRAINWIRE_NO_ENCODER
+
+static void brainwire_spikes_begin(brainwire_spikes_t *spikes, int index) {
+	spikes->index = index;
+	spikes->pos = 0;
+}
+
+static inline int brainwire_spikes_predict(brainwire_spikes_t *spikes) {
+	if (spikes->pos < 0 || spikes->index < 0) {
+		return 0;
+	}
+	return spikes->templates[spikes->index][spikes->pos];
+}
+
+static void brainwire_spikes_learn(brainwire_spikes_t *spikes) {
+	int16_t learned[BRAINWIRE_SPIKE_LEN];
+	int from = spikes->index;
+	if (from >= 0) {
+		for (int i = 0; i < BRAINWIRE_SPIKE_LEN; i++) {
+			learned[i] = (spikes->templates[from][i] + spikes->window[i]) >> 1;
+		}
+	}
+	else {
+		memcpy(learned, spikes->window, sizeof(learned));
+		from = spikes->num_templates < BRAINWIRE_SPIKE_TEMPLATES 
+			? spikes->num_templates++ 
+			: BRAINWIRE_SPIKE_TEMPLATES - 1;
+	}
+
+	// Move to front
+	memmove(spikes->templates[1], spikes->templates[0], from * sizeof(learned));
+	memcpy(spikes->templates[0], learned, sizeof(learned));
+}
+
+// Push the residual (before template subtraction) of the current sample. 
+// Returns 1 if this sample triggers a new event
+static inline int brainwire_spikes_push(brainwire_spikes_t *spikes, int residual, int rice_k) {
+	if (spikes->pos >= 0) {
+		spikes->window[spikes->pos++] = brainwire_spikes_clamp(residual);
+		if (spikes->pos == BRAINWIRE_SPIKE_LEN) {
+			brainwire_spikes_learn(spikes);
+			spikes->pos = -1;
+		}
+		return 0;
+	}
+
+	// k is masked like in the rice coder; only malformed streams exceed 31
+	int uval = residual < 0 ? -residual : residual;
+	return ((uval << 1) >> (rice_k & 31)) >= BRAINWIRE_SPIKE_THRESHOLD;
+}
+
+
+
+/* Progressive mode. The quantized samples are split into blocks of 
+BRAINWIRE_WAVELET_BLOCK samples, each of which is transformed with
+BRAINWIRE_WAVELET_LEVELS of the reversible integer 5/3 lifting wavelet (as in 
+JPEG2000), using symmetric extension at the block edges. The coefficients of
+a block are stored in place as [lowpass L, highpass L, highpass L-1, ... 1].
+
+The stream then contains the subbands coarse-to-fine, each across all blocks:
+first the lowpass band (delta coded), then the highpass bands from the 
+coarsest to the finest. Each band is prefixed by its byte length and starts
+on a byte boundary, so a client can fetch just the bands it needs. Decoding
+only up to the lowpass band of level N yields the signal at samplerate/2^N. */
+
+#define BRAINWIRE_WAVELET_BLOCK 4096
+#define BRAINWIRE_WAVELET_LEVELS 4
+
+#ifndef BRAINWIRE_NO_ENCODER
+static void brainwire_lift_forward(int *x, int *tmp, int n) {
+	int ns = (n + 1) / 2;
+	int nd = n / 2;
+	int *s = tmp;
+	int *d = tmp + ns;
+
+	for (int i = 0; i < nd; i++) {
+		int right = (2 * i + 2 < n) ? x[2 * i + 2] : x[2 * i];
+		d[i] = x[2 * i + 1] - ((x[2 * i] + right) >> 1);
+	}
+	for (int i = 0; i < ns; i++) {
+		int dl = nd ? d[i > 0 ? i - 1 : 0] : 0;
+		int dr = nd ? d[i < nd ? i : nd - 1] : 0;
+		s[i] = x[2 * i] + ((dl + dr + 2) >> 2);
+	}
+	memcpy(x, tmp, n * sizeof(int));
+}
+#endif
+
+static void brainwire_lift_inverse(int *x, int *tmp, int n) {
+	int ns = (n + 1) / 2;
+	int nd = n / 2;
+	int *s = x;
+	int *d = x + ns;
+
+	for (int i = 0; i < ns; i++) {
+		int dl = nd ? d[i > 0 ? i - 1 : 0] : 0;
+		int dr = nd ? d[i < nd ? i : nd - 1] : 0;
+		tmp[2 * i] = s[i] - ((dl + dr + 2) >> 2);
+	}
+	for (int i = 0; i < nd; i++) {
+		int right = (2 * i + 2 < n) ? tmp[2 * i + 2] : tmp[2 * i];
+		tmp[2 * i + 1] = d[i] + ((tmp[2 * i] + right) >> 1);
+	}
+	memcpy(x, tmp, n * sizeof(int));
+}
+
+// Offset and length of band (0 = lowpass, 1 = coarsest highpass, ...) within
+// a transformed block of n samples
+static void brainwire_wavelet_band(int n, int band, int *offset, int *len) {
+	int lens[BRAINWIRE_WAVELET_LEVELS + 1];
+	lens[0] = n;
+	for (int l = 1; l <= BRAINWIRE_WAVELET_LEVELS; l++) {
+		lens[l] = (lens[l - 1] + 1) / 2;
+	}
+
+	if (band == 0) {
+		*offset = 0;
+		*len = lens[BRAINWIRE_WAVELET_LEVELS];
+	}
+	else {
+		int level = BRAINWIRE_WAVELET_LEVELS - band + 1;
+		*offset = lens[level];
+		*len = lens[level - 1] / 2;
+	}
+}
+
+#ifndef BRAINWIRE_NO_ENCODER
+// The longest code of a band coefficient. Each lifting level at most doubles
+// the range of 10 bit codes, and the lowpass band is delta coded, so the
+// rice code of one takes at most 2^(12 + BRAINWIRE_WAVELET_LEVELS) + 1 + 31
+// bits at k = 0. The word-wise writer stores 8 bytes at the end.
+#define BRAINWIRE_WAVELET_MAX_CODE_BYTES (((1 << (12 + BRAINWIRE_WAVELET_LEVELS)) + 1 + 31 + 7) / 8 + 8)
+
+// Writes the bands into the buffer in *bytes of *size bytes, which grows as
+// with brainwire_reserve(). Returns the bit position after the bands, or -1
+// if out of memory
+static int brainwire_wavelet_write(uint8_t **bytes, int *size, int bit_pos, short *sample_data, int samples, int format) {
+	int *coeffs = brainwire_malloc(samples * sizeof(int));
+	if (!coeffs) {
+		brainwire_error = "Malloc failed";
+		return -1;
+	}
+	int tmp[BRAINWIRE_WAVELET_BLOCK];
+	for (int i = 0; i < samples; i++) {
+		coeffs[i] = format == BRAINWIRE_FORMAT_CODES ? sample_data[i] : brainwire_quant(sample_data[i]);
+	}
+
+	for (int b = 0; b < samples; b += BRAINWIRE_WAVELET_BLOCK) {
+		int n = samples - b < BRAINWIRE_WAVELET_BLOCK ? samples - b : BRAINWIRE_WAVELET_BLOCK;
+		for (int l = 0; l < BRAINWIRE_WAVELET_LEVELS; l++) {
+			brainwire_lift_forward(coeffs + b, tmp, n);
+			n = (n + 1) / 2;
+		}
+	}
+
+	// Each band is coded into a scratch buffer first, so that we can write
+	// its length in front of it. Like the stream, it grows for bands that
+	// take more than 2 bytes per coefficient.
+	int scratch_size = samples * 2 + 64;
+	uint8_t *scratch = brainwire_malloc(scratch_size + BRAINWIRE_PADDING);
+	if (!scratch) {
+		brainwire_free(coeffs);
+		brainwire_error = "Malloc failed";
+		return -1;
+	}
+
+	for (int band = 0; band <= BRAINWIRE_WAVELET_LEVELS; band++) {
+		BRAINWIRE_PROBE3(block, band, bit_pos, 3);
+		memset(scratch, 0, scratch_size);
+		int band_bit_pos = 0;
+		float rice_k = 3;
+		int prev = 0;
+
+		for (int b = 0; b < samples; b += BRAINWIRE_WAVELET_BLOCK) {
+			int n = samples - b < BRAINWIRE_WAVELET_BLOCK ? samples - b : BRAINWIRE_WAVELET_BLOCK;
+			int offset, len;
+			brainwire_wavelet_band(n, band, &offset, &len);
+
+			for (int i = 0; i < len; i++) {
+				int residual = coeffs[b + offset + i];
+				if (band == 0) {
+					residual -= prev;
+					prev = coeffs[b + offset + i];
+				}
+				if (band_bit_pos / 8 + BRAINWIRE_WAVELET_MAX_CODE_BYTES > scratch_size) {
+					if (!brainwire_reserve(&scratch, &scratch_size, band_bit_pos / 8 + BRAINWIRE_WAVELET_MAX_CODE_BYTES)) {
+						brainwire_free(scratch);
+						brainwire_free(coeffs);
+						return -1;
+					}
+				}
+				int encoded_len = rice_write(scratch, &band_bit_pos, residual, rice_k);
+				rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+			}
+		}
+
+		// The length takes 17 bits and one more per 2^15 bytes, before the
+		// alignment
+		int band_bytes = (band_bit_pos + 7) / 8;
+		if (!brainwire_reserve(bytes, size, bit_pos / 8 + (band_bytes >> 18) + 16 + band_bytes)) {
+			brainwire_free(scratch);
+			brainwire_free(coeffs);
+			return -1;
+		}
+		rice_write(*bytes, &bit_pos, band_bytes, 16);
+		bit_pos = (bit_pos + 7) & ~7;
+		memcpy(*bytes + (bit_pos >> 3), scratch, band_bytes);
+		bit_pos += band_bytes * 8;
+	}
+
+	brainwire_free(scratch);
+	brainwire_free(coeffs);
+	return bit_pos;
+}
+#endif // BRAINWIRE_NO_ENCODER
+
+// Returns the number of samples written to sample_data, which is less than
+// samples for a preview_level > 0, or -1 if the stream is malformed or out
+// of memory
+static int brainwire_wavelet_read(uint8_t *bytes, int size, int bit_pos, void *sample_data, int samples, int preview_level, int format) {
+	int64_t end = (int64_t)size * 8;
+	int *coeffs = brainwire_malloc(samples * sizeof(int));
+	if (!coeffs) {
+		brainwire_error = "Malloc failed";
+		return -1;
+	}
+	int tmp[BRAINWIRE_WAVELET_BLOCK];
+	int bands = BRAINWIRE_WAVELET_LEVELS - preview_level;
+
+	for (int band = 0; band <= bands; band++) {
+		BRAINWIRE_PROBE3(block, band, bit_pos, 3);
+		int band_bytes = rice_read(bytes, &bit_pos, 16);
+		bit_pos = (bit_pos + 7) & ~7;
+		int64_t band_end = bit_pos + (int64_t)band_bytes * 8;
+		if (band_bytes < 0 || band_end > end) {
+			brainwire_free(coeffs);
+			brainwire_error = "Band exceeds the stream";
+			return -1;
+		}
+		float rice_k = 3;
+		int prev = 0;
+
+		for (int b = 0; b < samples; b += BRAINWIRE_WAVELET_BLOCK) {
+			int n = samples - b < BRAINWIRE_WAVELET_BLOCK ? samples - b : BRAINWIRE_WAVELET_BLOCK;
+			int offset, len;
+			brainwire_wavelet_band(n, band, &offset, &len);
+
+			for (int i = 0; i < len; i++) {
+				int temp = bit_pos;
+				// Wrapped to 16 bits, so that the sums here and in the 
+				// inverse lifting can't overflow on malformed streams
+				int v = (int16_t)rice_read(bytes, &bit_pos, rice_k);
+				if (band == 0) {
+					v = (int16_t)(v + prev);
+					prev = v;
+				}
+				coeffs[b + offset + i] = v;
+				int encoded_len = bit_pos - temp;
+				rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+			}
+			if (bit_pos > end) {
+				brainwire_free(coeffs);
+				brainwire_error = "Unexpected end of stream";
+				return -1;
+			}
+		}
+		bit_pos = band_end;
+	}
+
+	int out_len = 0;
+	for (int b = 0; b < samples; b += BRAINWIRE_WAVELET_BLOCK) {
+		int lens[BRAINWIRE_WAVELET_LEVELS + 1];
+		lens[0] = samples - b < BRAINWIRE_WAVELET_BLOCK ? samples - b : BRAINWIRE_WAVELET_BLOCK;
+		for (int l = 1; l <= BRAINWIRE_WAVELET_LEVELS; l++) {
+			lens[l] = (lens[l - 1] + 1) / 2;
+		}
+		for (int l = BRAINWIRE_WAVELET_LEVELS; l > preview_level; l--) {
+			brainwire_lift_inverse(coeffs + b, tmp, lens[l - 1]);
+		}
+		for (int i = 0; i < lens[preview_level]; i++) {
+			brainwire_put_sample(sample_data, out_len++, coeffs[b + i], format);
+		}
+	}
+
+	brainwire_free(coeffs);
+	return out_len;
+}
+
+/* -----------------------------------------------------------------------------
+	Sample loops, with runtime CPU dispatch
+
+The per-sample loops of the encoder and decoder (quantization, prediction, 
+rice coding, reconstruction) are compiled for several instruction sets: the
+generic build target and, on x86 with gcc or clang, SSE4.2, BMI2, AVX2 and
+AVX-512. The best one supported by the CPU is selected on first use; the 
+environment variable BRAINWIRE_ISA (generic, sse4.2, bmi2, avx2, avx512) 
+forces one. All produce bit-identical output; FMA is left out of the target
+sets, since contracting the rice_k update would change it. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(BRAINWIRE_NO_DISPATCH)
+	#define BRAINWIRE_DISPATCH
+	#define BRAINWIRE_ALWAYS_INLINE __attribute__((always_inline))
+#else
+	#define BRAINWIRE_ALWAYS_INLINE
+#endif
+
+typedef struct {
+	uint8_t *bytes;
+	int bit_pos;
+	int64_t end; // the stream size in bits; for the encoder, of its buffer
+	int samples;
+	int samplerate;
+	int flags;
+	int mains_hz;
+	int frame_len;   // with BRAINWIRE_FLAG_FRAMES
+	int frames_pos;  // ... and the byte offset of the frame table
+	int format;      // BRAINWIRE_FORMAT_* of sample_data
+	int sample_offset; // of the first sample in the file, for probes and spikes_fh
+	FILE *spikes_fh; // decoder only
+	int skip;        // decoder only: samples decoded before the first written
+	int prev_quantized; // decoder only: the state to start from, and after
+	float rice_k;       // the call, for frames and the checkpoint index
+	int verify_pos;  // encoder only: the first sample bit, as read back, or -1
+	int mismatch;    // encoder only: the first sample that failed to verify
+	int64_t max_pos; // encoder only: the bit_pos it gives up after, see below
+	brainwire_opts_t *opts;
+} brainwire_stream_t;
+
+// The longest code of a sample. Residuals of 10 bit codes, less the hum and
+// spike estimates (which stay within the range of the residuals they follow),
+// are within +-4092, so the rice code of one takes at most 2^13 + 1 + 31 bits 
+// at k = 0, and a spike template index after it at most 18. The word-wise 
+// writer stores 8 bytes at the end.
+#define BRAINWIRE_MAX_SAMPLE_BYTES ((8192 + 1 + 31 + 18 + 7) / 8 + 8)
+
+// The decoder state between samples. The encoder runs a second decoder with
+// this to verify its output, see brainwire_encode_samples()
+typedef struct {
+	int bit_pos;
+	float rice_k;
+	int prev_quantized;
+	int probe_k;
+	brainwire_hum_t hum;
+	brainwire_spikes_t spikes;
+} brainwire_decoder_t;
+
+static void brainwire_decoder_init(brainwire_decoder_t *d, int bit_pos, float rice_k, int prev_quantized, int mains_hz, int samplerate) {
+	d->bit_pos = bit_pos;
+	d->rice_k = rice_k;
+	d->prev_quantized = prev_quantized;
+	d->probe_k = d->rice_k;
+	brainwire_hum_init(&d->hum, mains_hz, samplerate);
+	brainwire_spikes_init(&d->spikes);
+}
+
+// Decodes sample i and returns its quantized value. An invalid spike template
+// index sets *error; the bit position is left to the caller to check once per
+// block.
+static inline BRAINWIRE_ALWAYS_INLINE int brainwire_decode_sample(
+	brainwire_decoder_t *d, uint8_t *bytes, int i, int flags, FILE *spikes_fh,
+	brainwire_stats_t *stats, const int probes, const int words, const char **error
+) {
+	int temp = d->bit_pos;
+
+	// Residuals and quantized values wrap to 16 bits, like the codes of the
+	// sample loops. This doesn't change valid streams, but keeps residuals of
+	// up to 32 bits in malformed ones from overflowing the sums below.
+	int hum_est = (flags & BRAINWIRE_FLAG_HUM) ? brainwire_hum_predict(&d->hum) : 0;
+	int residual = (int16_t)(words ? rice_read_word(bytes, &d->bit_pos, d->rice_k) : rice_read(bytes, &d->bit_pos, d->rice_k));
+	BRAINWIRE_STATS_RECORD(stats, residual, d->rice_k, d->bit_pos - temp);
+	if (probes) {
+		BRAINWIRE_PROBE_SAMPLE(i, temp, (int)d->rice_k, d->probe_k, residual, d->bit_pos - temp);
+	}
+	if (flags & BRAINWIRE_FLAG_SPIKES) {
+		residual += brainwire_spikes_predict(&d->spikes);
+	}
+	int quantized = (int16_t)(d->prev_quantized + residual + hum_est);
+	if (flags & BRAINWIRE_FLAG_HUM) {
+		brainwire_hum_update(&d->hum, quantized - d->prev_quantized);
+	}
+	d->prev_quantized = quantized;
+
+	int encoded_len = d->bit_pos - temp;
+	d->rice_k = d->rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+
+	if ((flags & BRAINWIRE_FLAG_SPIKES) && brainwire_spikes_push(&d->spikes, residual, d->rice_k)) {
+		int index = (words ? rice_read_word(bytes, &d->bit_pos, 1) : rice_read(bytes, &d->bit_pos, 1)) - 1;
+		if (index < -1 || index >= BRAINWIRE_SPIKE_TEMPLATES) {
+			*error = "Invalid spike template";
+			index = -1;
+		}
+		brainwire_spikes_begin(&d->spikes, index);
+		if (spikes_fh) {
+			fprintf(spikes_fh, "%d,%d\n", i, index);
+		}
+	}
+	return quantized;
+}
+
+// The same as brainwire_dequant() for the values of brainwire_quant(), -512
+// to 511, but integer only and without branches, so that a loop over a block
+// vectorizes; bwcheck verifies this for all of them.
+static inline int brainwire_dequant_10bit(int v) {
+	int sign = v >> 31;
+	int u = v ^ sign;
+	return (64 * u + 31 + ((u * 1009 + 8694) >> 14)) ^ sign;
+}
+
+// Writes the len quantized values to out as samples in the format. For the
+// values of brainwire_quant(), each loop vectorizes with the integer only
+// brainwire_dequant_10bit() and the conversion fused in.
+static inline BRAINWIRE_ALWAYS_INLINE void brainwire_reconstruct(void *out, const int16_t *quantized, int len, int format) {
+	if (format == BRAINWIRE_FORMAT_CODES) {
+		memcpy(out, quantized, len * sizeof(short));
+		return;
+	}
+
+	int in_range = 1;
+	for (int j = 0; j < len; j++) {
+		in_range &= quantized[j] >= -512 && quantized[j] < 512;
+	}
+	if (!in_range) {
+		for (int j = 0; j < len; j++) {
+			brainwire_put_sample(out, j, quantized[j], format);
+		}
+	}
+	else if (format == BRAINWIRE_FORMAT_F32) {
+		float *f32 = out;
+		for (int j = 0; j < len; j++) {
+			f32[j] = brainwire_f32(brainwire_dequant_10bit(quantized[j]));
+		}
+	}
+	else if (format == BRAINWIRE_FORMAT_F16) {
+		uint16_t *f16 = out;
+		for (int j = 0; j < len; j++) {
+			f16[j] = brainwire_f16(brainwire_dequant_10bit(quantized[j]));
+		}
+	}
+	else {
+		short *s16 = out;
+		for (int j = 0; j < len; j++) {
+			s16[j] = brainwire_dequant_10bit(quantized[j]);
+		}
+	}
+}
+
+#ifndef BRAINWIRE_NO_ENCODER
+
+// Returns the index of the first short that differs, or -1
+static inline int brainwire_compare(const short *a, const short *b, int len) {
+	int i = 0;
+	#if defined(__SSE2__)
+		for (; i + 8 <= len; i += 8) {
+			__m128i eq = _mm_cmpeq_epi16(
+				_mm_loadu_si128((const __m128i *)(a + i)), 
+				_mm_loadu_si128((const __m128i *)(b + i))
+			);
+			int mask = _mm_movemask_epi8(eq);
+			if (mask != 0xffff) {
+				return i + __builtin_ctz(~mask) / 2;
+			}
+		}
+	#endif
+	for (; i < len; i++) {
+		if (a[i] != b[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// With verify, a second decoder follows the encoder one block behind, in the
+// same loop, and the decoded samples of each block are compared with the 
+// input. The decoder's loop carried chain (bit_pos and rice_k) is independent
+// of the encoder's, so out of order CPUs run both side by side and the
+// verification costs much less than decoding afterwards. Returns early, with
+// s->mismatch set, at the first block that fails. The buffer in s->bytes 
+// grows when less than the longest code of a sample is left; if that fails,
+// or the stream is already past s->max_pos then, s->bit_pos is set to -1.
+static inline BRAINWIRE_ALWAYS_INLINE void brainwire_encode_samples(brainwire_stream_t *s, short *sample_data, const int words, const int verify) {
+	uint8_t *bytes = s->bytes;
+	int bit_pos = s->bit_pos;
+	int samples = s->samples;
+	int samplerate = s->samplerate;
+	int flags = s->flags;
+	int mains_hz = s->mains_hz;
+	int codes = s->format == BRAINWIRE_FORMAT_CODES;
+	int sample_offset = s->sample_offset;
+	(void)sample_offset; // only used by the USDT probes
+	brainwire_opts_t *opts = s->opts;
+	float rice_k = 3;
+
+	brainwire_hum_t hum;
+	brainwire_hum_init(&hum, mains_hz, samplerate);
+
+	brainwire_spikes_t spikes;
+	brainwire_spikes_init(&spikes);
+
+	brainwire_decoder_t verifier;
+	int16_t verify_block[BRAINWIRE_BLOCK];
+	short verify_samples[BRAINWIRE_BLOCK];
+	const char *verify_error = NULL;
+	if (verify) {
+		brainwire_decoder_init(&verifier, s->verify_pos, 3, 0, mains_hz, samplerate);
+	}
+	s->mismatch = -1;
+	
+	// Samples are encoded in blocks: quantization first, in a separate tight
+	// loop, then entropy coding. The verification needs one more block to 
+	// catch up.
+	int16_t quantized_block[BRAINWIRE_BLOCK];
+	int prev_quantized = 0;
+	int64_t grow_pos = s->end - BRAINWIRE_MAX_SAMPLE_BYTES * 8;
+	int probe_k = rice_k;
+	(void)probe_k; // only used by the USDT probes
+	for (int block = 0; block < samples + (verify ? BRAINWIRE_BLOCK : 0); block += BRAINWIRE_BLOCK) {
+		int block_len = samples - block < BRAINWIRE_BLOCK ? samples - block : BRAINWIRE_BLOCK;
+		block_len = block_len > 0 ? block_len : 0;
+
+		BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_QUANT);
+		if (codes) {
+			memcpy(quantized_block, sample_data + block, block_len * sizeof(short));
+		}
+		else {
+			for (int j = 0; j < block_len; j++) {
+				quantized_block[j] = brainwire_quant(sample_data[block + j]);
+			}
+		}
+		BRAINWIRE_PERF_END(BRAINWIRE_PERF_QUANT);
+
+		BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_ENTROPY);
+		for (int j = 0; j < block_len; j++) {
+			int i = block + j;
+			if (bit_pos > grow_pos) {
+				int size = (int)(s->end / 8);
+				if (bit_pos > s->max_pos || !brainwire_reserve(&s->bytes, &size, bit_pos / 8 + BRAINWIRE_MAX_SAMPLE_BYTES)) {
+					BRAINWIRE_PERF_END(BRAINWIRE_PERF_ENTROPY);
+					s->bit_pos = -1;
+					return;
+				}
+				bytes = s->bytes;
+				s->end = (int64_t)size * 8;
+				grow_pos = s->end - BRAINWIRE_MAX_SAMPLE_BYTES * 8;
+			}
+			BRAINWIRE_LATENCY_BEGIN();
+			int quantized = quantized_block[j];
+			int hum_est = (flags & BRAINWIRE_FLAG_HUM) ? brainwire_hum_predict(&hum) : 0;
+			int residual = quantized - prev_quantized - hum_est;
+			if (flags & BRAINWIRE_FLAG_HUM) {
+				brainwire_hum_update(&hum, quantized - prev_quantized);
+			}
+			prev_quantized = quantized;
+
+			int spike_est = (flags & BRAINWIRE_FLAG_SPIKES) ? brainwire_spikes_predict(&spikes) : 0;
+			int encoded_len = words
+				? rice_write_word(bytes, &bit_pos, residual - spike_est, rice_k)
+				: rice_write(bytes, &bit_pos, residual - spike_est, rice_k);
+			BRAINWIRE_STATS_RECORD(opts->stats, residual - spike_est, rice_k, encoded_len);
+			BRAINWIRE_PROBE_SAMPLE(sample_offset + i, bit_pos - encoded_len, (int)rice_k, probe_k, residual - spike_est, encoded_len);
+			rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+
+			if ((flags & BRAINWIRE_FLAG_SPIKES) && brainwire_spikes_push(&spikes, residual, rice_k)) {
+				// Look ahead at the plain sample differences; ignoring the hum
+				// estimate here only affects the choice of template
+				int16_t upcoming[BRAINWIRE_SPIKE_LEN] = {0};
+				for (int n = 0; n < BRAINWIRE_SPIKE_LEN && i + n + 1 < samples; n++) {
+					upcoming[n] = brainwire_spikes_clamp(codes
+						? sample_data[i + n + 1] - sample_data[i + n]
+						: brainwire_quant(sample_data[i + n + 1]) - brainwire_quant(sample_data[i + n])
+					);
+				}
+				int index = brainwire_spikes_match(&spikes, upcoming);
+				if (words) {
+					rice_write_word(bytes, &bit_pos, index + 1, 1);
+				}
+				else {
+					rice_write(bytes, &bit_pos, index + 1, 1);
+				}
+				brainwire_spikes_begin(&spikes, index);
+			}
+
+			if (verify && block > 0) {
+				verify_block[j] = brainwire_decode_sample(
+					&verifier, bytes, i - BRAINWIRE_BLOCK, flags, NULL, NULL, 0, words, &verify_error
+				);
+			}
+			BRAINWIRE_LATENCY_END(BRAINWIRE_LATENCY_ENCODE);
+		}
+		BRAINWIRE_PERF_END(BRAINWIRE_PERF_ENTROPY);
+
+		if (verify && block > 0) {
+			// The rest of the previous block, if this one is shorter
+			int prev_block = block - BRAINWIRE_BLOCK;
+			int prev_len = samples - prev_block < BRAINWIRE_BLOCK ? samples - prev_block : BRAINWIRE_BLOCK;
+			for (int j = block_len; j < prev_len; j++) {
+				verify_block[j] = brainwire_decode_sample(
+					&verifier, bytes, prev_block + j, flags, NULL, NULL, 0, words, &verify_error
+				);
+			}
+
+			// The decoder must not have read into what is not written yet
+			if (verifier.bit_pos > bit_pos || verify_error) {
+				s->mismatch = prev_block;
+				return;
+			}
+			// Codes are compared as they are
+			short *verify_data = verify_block;
+			if (!codes) {
+				int in_range = 1;
+				for (int j = 0; j < prev_len; j++) {
+					in_range &= verify_block[j] >= -512 && verify_block[j] < 512;
+					verify_samples[j] = brainwire_dequant_10bit(verify_block[j]);
+				}
+				if (!in_range) {
+					for (int j = 0; j < prev_len; j++) {
+						verify_samples[j] = brainwire_dequant(verify_block[j]);
+					}
+				}
+				verify_data = verify_samples;
+			}
+			int mismatch = brainwire_compare(verify_data, sample_data + prev_block, prev_len);
+			if (mismatch >= 0) {
+				s->mismatch = prev_block + mismatch;
+				return;
+			}
+		}
+	}
+
+	s->bit_pos = bit_pos;
+}
+#endif // BRAINWIRE_NO_ENCODER
+
+// Decodes s->samples samples from the state in s and leaves the state after
+// them there. The first s->skip samples, or all without sample_data, are only
+// decoded, not reconstructed. Returns NULL, or the error if the stream is 
+// malformed.
+static inline BRAINWIRE_ALWAYS_INLINE const char *brainwire_decode_samples(brainwire_stream_t *s, void *sample_data, const int words) {
+	uint8_t *bytes = s->bytes;
+	int64_t end = s->end;
+	int samples = s->samples;
+	int flags = s->flags;
+	int format = s->format;
+	int sample_size = brainwire_sample_size(format);
+	int sample_offset = s->sample_offset;
+	int skip = s->skip;
+	FILE *spikes_fh = s->spikes_fh;
+	brainwire_opts_t *opts = s->opts;
+
+	brainwire_decoder_t d;
+	brainwire_decoder_init(&d, s->bit_pos, s->rice_k, s->prev_quantized, s->mains_hz, s->samplerate);
+
+	// Samples are decoded in blocks: entropy decoding first, then 
+	// reconstruction in a separate tight loop
+	int16_t quantized_block[BRAINWIRE_BLOCK];
+	const char *error = NULL;
+	for (int block = 0; block < samples; block += BRAINWIRE_BLOCK) {
+		int block_len = samples - block < BRAINWIRE_BLOCK ? samples - block : BRAINWIRE_BLOCK;
+
+		BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_ENTROPY);
+		for (int j = 0; j < block_len; j++) {
+			BRAINWIRE_LATENCY_BEGIN();
+			quantized_block[j] = brainwire_decode_sample(
+				&d, bytes, sample_offset + block + j, flags, spikes_fh, opts->stats, 1, words, &error
+			);
+			if (error) {
+				return error;
+			}
+			BRAINWIRE_LATENCY_END(BRAINWIRE_LATENCY_DECODE);
+		}
+		BRAINWIRE_PERF_END(BRAINWIRE_PERF_ENTROPY);
+		if (d.bit_pos > end) {
+			return "Unexpected end of stream";
+		}
+		if (!sample_data || block + block_len <= skip) {
+			continue;
+		}
+
+		// Sample block + j goes to sample_data[block + j - skip]
+		BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_DEQUANT);
+		int first = skip > block ? skip - block : 0;
+		brainwire_reconstruct(
+			(uint8_t *)sample_data + (block + first - skip) * sample_size, 
+			quantized_block + first, block_len - first, format
+		);
+		BRAINWIRE_PERF_END(BRAINWIRE_PERF_DEQUANT);
+	}
+
+	s->bit_pos = d.bit_pos;
+	s->prev_quantized = d.prev_quantized;
+	s->rice_k = d.rice_k;
+	return NULL;
+}
+
+/* The bit packing of .bw10 files, see "Packed 10 bit files". Code i is 
+stored as code + 512 in bits 10 * i to 10 * i + 9, least significant first,
+so each group of 8 codes fills 10 bytes. With SSSE3 (the kernel sets from 
+SSE4.2 on), a group is unpacked with one shuffle that moves the two bytes of
+each code into its 16 bit lane and a multiply and shift that align and mask
+it, and packed with a multiply-add, shifts and one shuffle. These load and
+store 16 bytes for the 10 of a group, so the buffers need 6 bytes of slack.
+The scalar loops handle the rest and the generic set. */
+
+#if defined(BRAINWIRE_DISPATCH) || defined(__SSSE3__)
+	#include <tmmintrin.h>
+	#define BRAINWIRE_SSSE3 __attribute__((target("ssse3")))
+
+	BRAINWIRE_SSSE3 static inline void brainwire_unpack10_group(const uint8_t *p, int16_t *codes) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		v = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 6, 7, 7, 8, 8, 9));
+		v = _mm_srli_epi16(_mm_mullo_epi16(v, _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1)), 6);
+		_mm_storeu_si128((__m128i *)codes, _mm_sub_epi16(v, _mm_set1_epi16(512)));
+	}
+
+	BRAINWIRE_SSSE3 static inline void brainwire_pack10_group(uint8_t *p, const int16_t *codes) {
+		__m128i v = _mm_add_epi16(_mm_loadu_si128((const __m128i *)codes), _mm_set1_epi16(512));
+		v = _mm_madd_epi16(v, _mm_set1_epi32(1 << 26 | 1)); // 2 codes per 32 bits
+		__m128i lo = _mm_and_si128(v, _mm_set1_epi64x(0xfffff));
+		__m128i hi = _mm_and_si128(_mm_srli_epi64(v, 12), _mm_set1_epi64x(0xfffff00000ll));
+		v = _mm_shuffle_epi8(_mm_or_si128(lo, hi), _mm_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1));
+		_mm_storeu_si128((__m128i *)p, v);
+	}
+#endif
+
+static inline int brainwire_unpack10_code(const uint8_t *bytes, int64_t i) {
+	int64_t bit = 10 * i;
+	int w = bytes[bit >> 3] | (bytes[(bit >> 3) + 1] << 8);
+	return ((w >> (bit & 7)) & 0x3ff) - 512;
+}
+
+// Unpacks count codes from code first on
+static inline BRAINWIRE_ALWAYS_INLINE void brainwire_unpack10(const uint8_t *bytes, int64_t first, int count, int16_t *codes, const int simd) {
+	int i = 0;
+	for (; i < count && ((first + i) & 7); i++) {
+		codes[i] = brainwire_unpack10_code(bytes, first + i);
+	}
+	#ifdef BRAINWIRE_SSSE3
+		for (; simd && i + 8 <= count; i += 8) {
+			brainwire_unpack10_group(bytes + (first + i) / 8 * 10, codes + i);
+		}
+	#endif
+	for (; i < count; i++) {
+		codes[i] = brainwire_unpack10_code(bytes, first + i);
+	}
+}
+
+// Unpacks count samples from sample first on and writes them to out in the
+// format, per block
+static inline BRAINWIRE_ALWAYS_INLINE void brainwire_unpack10_samples(const uint8_t *bytes, int first, int count, void *out, int format, const int simd) {
+	int16_t codes[BRAINWIRE_BLOCK];
+	int sample_size = brainwire_sample_size(format);
+	for (int block = 0; block < count; block += BRAINWIRE_BLOCK) {
+		int block_len = count - block < BRAINWIRE_BLOCK ? count - block : BRAINWIRE_BLOCK;
+		brainwire_unpack10(bytes, (int64_t)first + block, block_len, codes, simd);
+		brainwire_reconstruct((uint8_t *)out + (size_t)block * sample_size, codes, block_len, format);
+	}
+}
+
+#ifndef BRAINWIRE_NO_ENCODER
+
+// Packs the samples, in BRAINWIRE_FORMAT_S16 or CODES, into the zeroed bytes
+static inline BRAINWIRE_ALWAYS_INLINE void brainwire_pack10_samples(uint8_t *bytes, const short *sample_data, int samples, int format, const int simd) {
+	int16_t quantized_block[BRAINWIRE_BLOCK];
+	for (int block = 0; block < samples; block += BRAINWIRE_BLOCK) {
+		int block_len = samples - block < BRAINWIRE_BLOCK ? samples - block : BRAINWIRE_BLOCK;
+		const int16_t *codes = sample_data + block;
+		if (format != BRAINWIRE_FORMAT_CODES) {
+			for (int j = 0; j < block_len; j++) {
+				quantized_block[j] = brainwire_quant(sample_data[block + j]);
+			}
+			codes = quantized_block;
+		}
+
+		// Blocks start on a group
+		int j = 0;
+		#ifdef BRAINWIRE_SSSE3
+			for (; simd && j + 8 <= block_len; j += 8) {
+				brainwire_pack10_group(bytes + (int64_t)(block + j) / 8 * 10, codes + j);
+			}
+		#endif
+		for (; j < block_len; j++) {
+			int64_t bit = 10 * ((int64_t)block + j);
+			int w = (codes[j] + 512) << (bit & 7);
+			bytes[bit >> 3] |= w;
+			bytes[(bit >> 3) + 1] |= w >> 8;
+		}
+	}
+}
+
+#endif // BRAINWIRE_NO_ENCODER
+
+/* Turbo blocks, for BRAINWIRE_FLAG_TURBO. Instead of rice coding, the
+residuals (the differences of successive codes) are coded in blocks of 128,
+frame-of-reference bit-packed like SIMD-BP128 and FastPFor: each block is
+byte aligned and has a 4 byte header (the bit width b, the number of
+exceptions e and the reference as i16, little endian), then the residuals
+minus the reference at b bits each, then e exception positions (u8) and the
+bits above b of these (u16, little endian). The encoder picks b per block so
+that the block is smallest. The values are interleaved over 4 lanes of 32 bit
+words, value i in lane i % 4, so that SSE2 unpacks 4 values with a shift, an
+or and an and, without a shuffle. A partial block at the end of a frame is
+padded with zeros. */
+
+#define BRAINWIRE_TURBO_LEN 128
+
+// The largest block: residuals of 10 bit codes take 11 bits
+#define BRAINWIRE_TURBO_MAX_BYTES (4 + 16 * 11)
+
+// Unpacks the BRAINWIRE_TURBO_LEN values of width b from in
+static inline BRAINWIRE_ALWAYS_INLINE void brainwire_turbo_unpack_width(const uint8_t *in, uint32_t *out, const int b) {
+	#if defined(__SSE2__)
+		const __m128i *words = (const __m128i *)in;
+		__m128i mask = _mm_set1_epi32((1u << b) - 1);
+		__m128i word = _mm_loadu_si128(words++);
+		#if defined(__GNUC__) && !defined(__OPTIMIZE_SIZE__)
+			#pragma GCC unroll 32
+		#endif
+		for (int k = 0, shift = 0; k < BRAINWIRE_TURBO_LEN / 4; k++) {
+			__m128i v = _mm_srli_epi32(word, shift);
+			shift += b;
+			if (shift >= 32 && k < BRAINWIRE_TURBO_LEN / 4 - 1) {
+				shift -= 32;
+				word = _mm_loadu_si128(words++);
+				if (shift > 0) {
+					v = _mm_or_si128(v, _mm_slli_epi32(word, b - shift));
+				}
+			}
+			_mm_storeu_si128((__m128i *)(out + 4 * k), _mm_and_si128(v, mask));
+		}
+	#else
+		uint32_t mask = (1u << b) - 1;
+		for (int i = 0; i < BRAINWIRE_TURBO_LEN; i++) {
+			int bit = (i >> 2) * b;
+			const uint8_t *w = in + ((bit >> 5) * 4 + (i & 3)) * 4;
+			uint64_t v = brainwire_get_u32((uint8_t *)w);
+			if ((bit & 31) + b > 32) {
+				v |= (uint64_t)brainwire_get_u32((uint8_t *)w + 16) << 32;
+			}
+			out[i] = (v >> (bit & 31)) & mask;
+		}
+	#endif
+}
+
+// With the width constant in each case, the shifts are immediates and the
+// loop unrolls without branches (except when optimizing for size)
+static inline BRAINWIRE_ALWAYS_INLINE void brainwire_turbo_unpack(const uint8_t *in, uint32_t *out, int b) {
+	switch (b) {
+		case  0: memset(out, 0, BRAINWIRE_TURBO_LEN * sizeof(uint32_t)); break;
+		case  1: brainwire_turbo_unpack_width(in, out,  1); break;
+		case  2: brainwire_turbo_unpack_width(in, out,  2); break;
+		case  3: brainwire_turbo_unpack_width(in, out,  3); break;
+		case  4: brainwire_turbo_unpack_width(in, out,  4); break;
+		case  5: brainwire_turbo_unpack_width(in, out,  5); break;
+		case  6: brainwire_turbo_unpack_width(in, out,  6); break;
+		case  7: brainwire_turbo_unpack_width(in, out,  7); break;
+		case  8: brainwire_turbo_unpack_width(in, out,  8); break;
+		case  9: brainwire_turbo_unpack_width(in, out,  9); break;
+		case 10: brainwire_turbo_unpack_width(in, out, 10); break;
+		case 11: brainwire_turbo_unpack_width(in, out, 11); break;
+		case 12: brainwire_turbo_unpack_width(in, out, 12); break;
+		case 13: brainwire_turbo_unpack_width(in, out, 13); break;
+		case 14: brainwire_turbo_unpack_width(in, out, 14); break;
+		case 15: brainwire_turbo_unpack_width(in, out, 15); break;
+		case 16: brainwire_turbo_unpack_width(in, out, 16); break;
+	}
+}
+
+// Adds the reference to the residuals and sums them up from prev into the
+// codes, wrapped to 16 bits like the rice decoder's. Returns the last code.
+static inline BRAINWIRE_ALWAYS_INLINE uint32_t brainwire_turbo_sum(const uint32_t *residuals, uint32_t ref, uint32_t prev, int16_t *codes) {
+	#if defined(__SSE2__)
+		__m128i run = _mm_set1_epi32(prev);
+		__m128i r = _mm_set1_epi32(ref);
+		for (int i = 0; i < BRAINWIRE_TURBO_LEN; i += 8) {
+			__m128i a = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(residuals + i)), r);
+			__m128i b = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(residuals + i + 4)), r);
+			a = _mm_add_epi32(a, _mm_slli_si128(a, 4));
+			b = _mm_add_epi32(b, _mm_slli_si128(b, 4));
+			a = _mm_add_epi32(a, _mm_slli_si128(a, 8));
+			b = _mm_add_epi32(b, _mm_slli_si128(b, 8));
+			a = _mm_add_epi32(a, run);
+			b = _mm_add_epi32(b, _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 3, 3)));
+			run = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 3, 3, 3));
+
+			// Sign extending the low halves makes the saturating pack a wrap
+			a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+			b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+			_mm_storeu_si128((__m128i *)(codes + i), _mm_packs_epi32(a, b));
+		}
+		return _mm_cvtsi128_si32(run);
+	#else
+		for (int i = 0; i < BRAINWIRE_TURBO_LEN; i++) {
+			prev += residuals[i] + ref;
+			codes[i] = (int16_t)prev;
+		}
+		return prev;
+	#endif
+}
+
+static inline BRAINWIRE_ALWAYS_INLINE const char *brainwire_turbo_decode_samples(brainwire_stream_t *s, void *sample_data) {
+	uint8_t *bytes = s->bytes;
+	int64_t pos = s->bit_pos / 8;
+	int64_t end = s->end / 8;
+	int samples = s->samples;
+	int format = s->format;
+	int sample_size = brainwire_sample_size(format);
+	int skip = s->skip;
+	uint32_t prev = s->prev_quantized;
+
+	// Blocks of BRAINWIRE_TURBO_LEN are unpacked and summed up into a block
+	// of codes, which is reconstructed as in brainwire_decode_samples()
+	int16_t quantized_block[BRAINWIRE_BLOCK + BRAINWIRE_TURBO_LEN];
+	uint32_t residuals[BRAINWIRE_TURBO_LEN];
+	for (int block = 0; block < samples; block += BRAINWIRE_BLOCK) {
+		int block_len = samples - block < BRAINWIRE_BLOCK ? samples - block : BRAINWIRE_BLOCK;
+
+		BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_ENTROPY);
+		for (int j = 0; j < block_len; j += BRAINWIRE_TURBO_LEN) {
+			if (pos + 4 > end) {
+				return "Unexpected end of stream";
+			}
+			uint8_t *p = bytes + pos;
+			int b = p[0];
+			int e = p[1];
+			uint32_t ref = (int16_t)(p[2] | (p[3] << 8));
+			if (b > 16 || e > BRAINWIRE_TURBO_LEN) {
+				return "Invalid turbo block";
+			}
+			pos += 4 + 16 * b + 3 * e;
+			if (pos > end) {
+				return "Unexpected end of stream";
+			}
+
+			brainwire_turbo_unpack(p + 4, residuals, b);
+			const uint8_t *exceptions = p + 4 + 16 * b;
+			for (int x = 0; x < e; x++) {
+				int i = exceptions[x];
+				if (i >= BRAINWIRE_TURBO_LEN) {
+					return "Invalid turbo block";
+				}
+				uint32_t high = exceptions[e + 2 * x] | (exceptions[e + 2 * x + 1] << 8);
+				residuals[i] |= high << b;
+			}
+			prev = brainwire_turbo_sum(residuals, ref, prev, quantized_block + j);
+		}
+		BRAINWIRE_PERF_END(BRAINWIRE_PERF_ENTROPY);
+
+		// The codes past the end of a partial block are padding
+		if (block_len % BRAINWIRE_TURBO_LEN) {
+			prev = quantized_block[block_len - 1];
+		}
+		if (!sample_data || block + block_len <= skip) {
+			continue;
+		}
+
+		BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_DEQUANT);
+		int first = skip > block ? skip - block : 0;
+		brainwire_reconstruct(
+			(uint8_t *)sample_data + (block + first - skip) * sample_size,
+			quantized_block + first, block_len - first, format
+		);
+		BRAINWIRE_PERF_END(BRAINWIRE_PERF_DEQUANT);
+	}
+
+	s->bit_pos = pos * 8;
+	s->prev_quantized = (int16_t)prev;
+	return NULL;
+}
+
+#ifndef BRAINWIRE_NO_ENCODER
+
+// Writes the samples, in BRAINWIRE_FORMAT_S16 or CODES within 10 bits, as
+// turbo blocks from byte pos on. Returns the byte position after them. This
+// is scalar; only the decoder has to be fast.
+static int brainwire_turbo_encode(uint8_t *bytes, int pos, const short *sample_data, int samples, int format) {
+	int prev = 0;
+	for (int block = 0; block < samples; block += BRAINWIRE_TURBO_LEN) {
+		int len = samples - block < BRAINWIRE_TURBO_LEN ? samples - block : BRAINWIRE_TURBO_LEN;
+		int residuals[BRAINWIRE_TURBO_LEN];
+		int ref = 0x7fff;
+		for (int j = 0; j < len; j++) {
+			int q = sample_data[block + j];
+			if (format != BRAINWIRE_FORMAT_CODES) {
+				q = brainwire_quant(q);
+			}
+			residuals[j] = q - prev;
+			prev = q;
+			ref = residuals[j] < ref ? residuals[j] : ref;
+		}
+
+		// Count the values by width, then find the width at which the packed
+		// values and the exceptions above it take the fewest bytes
+		uint32_t values[BRAINWIRE_TURBO_LEN] = {0};
+		int widths[18] = {0};
+		for (int j = 0; j < len; j++) {
+			values[j] = residuals[j] - ref;
+			int w = 0;
+			while (w < 17 && (values[j] >> w)) {
+				w++;
+			}
+			widths[w]++;
+		}
+		int b = 16;
+		int e = 0;
+		int best = INT32_MAX;
+		for (int w = 16, above = 0; w >= 0; w--) {
+			above += widths[w + 1];
+			if (16 * w + 3 * above < best) {
+				b = w;
+				e = above;
+				best = 16 * w + 3 * above;
+			}
+		}
+
+		uint8_t *p = bytes + pos;
+		p[0] = b;
+		p[1] = e;
+		p[2] = ref & 0xff;
+		p[3] = (ref >> 8) & 0xff;
+
+		uint32_t words[4 * 16] = {0};
+		uint8_t *exceptions = p + 4 + 16 * b;
+		for (int i = 0, x = 0; i < BRAINWIRE_TURBO_LEN; i++) {
+			uint32_t v = values[i] & ((1u << b) - 1);
+			int bit = (i >> 2) * b;
+			uint32_t *w = words + (bit >> 5) * 4 + (i & 3);
+			w[0] |= v << (bit & 31);
+			if ((bit & 31) + b > 32) {
+				w[4] |= v >> (32 - (bit & 31));
+			}
+			if (values[i] >> b) {
+				exceptions[x] = i;
+				exceptions[e + 2 * x] = (values[i] >> b) & 0xff;
+				exceptions[e + 2 * x + 1] = values[i] >> b >> 8;
+				x++;
+			}
+		}
+		for (int w = 0; w < 4 * b; w++) {
+			brainwire_put_u32(p + 4 + w * 4, words[w]);
+		}
+		pos += 4 + 16 * b + 3 * e;
+	}
+	return pos;
+}
+
+#endif // BRAINWIRE_NO_ENCODER
+
+typedef struct {
+	const char *name;
+	void (*encode_samples)(brainwire_stream_t *s, short *sample_data);
+	const char *(*decode_samples)(brainwire_stream_t *s, void *sample_data);
+	const char *(*decode_turbo)(brainwire_stream_t *s, void *sample_data);
+	void (*pack10)(uint8_t *bytes, const short *sample_data, int samples, int format);
+	void (*unpack10)(const uint8_t *bytes, int first, int count, void *out, int format);
+} brainwire_kernels_t;
+
+#ifndef BRAINWIRE_NO_ENCODER
+	#define BRAINWIRE_KERNELS_ENCODE(NAME, TARGET, WORDS, SIMD) \
+		TARGET static void brainwire_encode_samples_##NAME(brainwire_stream_t *s, short *sample_data) { \
+			if (s->verify_pos >= 0) { \
+				brainwire_encode_samples(s, sample_data, WORDS, 1); \
+			} \
+			else { \
+				brainwire_encode_samples(s, sample_data, WORDS, 0); \
+			} \
+		} \
+		TARGET static void brainwire_pack10_##NAME(uint8_t *bytes, const short *sample_data, int samples, int format) { \
+			brainwire_pack10_samples(bytes, sample_data, samples, format, SIMD); \
+		}
+	#define BRAINWIRE_KERNEL_SET(NAME, ISA) \
+		{ISA, brainwire_encode_samples_##NAME, brainwire_decode_samples_##NAME, \
+			brainwire_decode_turbo_##NAME, brainwire_pack10_##NAME, brainwire_unpack10_##NAME}
+#else
+	#define BRAINWIRE_KERNELS_ENCODE(NAME, TARGET, WORDS, SIMD)
+	#define BRAINWIRE_KERNEL_SET(NAME, ISA) \
+		{ISA, NULL, brainwire_decode_samples_##NAME, brainwire_decode_turbo_##NAME, \
+			NULL, brainwire_unpack10_##NAME}
+#endif
+
+// WORDS selects the word-wise rice coder, SIMD the SSSE3 bit packing
+#define BRAINWIRE_KERNELS(NAME, TARGET, WORDS, SIMD) \
+	BRAINWIRE_KERNELS_ENCODE(NAME, TARGET, WORDS, SIMD) \
+	TARGET static const char *brainwire_decode_samples_##NAME(brainwire_stream_t *s, void *sample_data) { \
+		return brainwire_decode_samples(s, sample_data, WORDS); \
+	} \
+	TARGET static const char *brainwire_decode_turbo_##NAME(brainwire_stream_t *s, void *sample_data) { \
+		return brainwire_turbo_decode_samples(s, sample_data); \
+	} \
+	TARGET static void brainwire_unpack10_##NAME(const uint8_t *bytes, int first, int count, void *out, int format) { \
+		brainwire_unpack10_samples(bytes, first, count, out, format, SIMD); \
+	}
+
+// With dispatch, the generic set is the fallback for old CPUs and keeps the
+// scalar rice coder. Built only once, for the build target, the word-wise 
+// coder is faster, even without BMI2.
+#ifdef BRAINWIRE_DISPATCH
+	BRAINWIRE_KERNELS(generic, , 0, 0)
+#elif defined(BRAINWIRE_SSSE3)
+	BRAINWIRE_KERNELS(generic, , 1, 1)
+#else
+	BRAINWIRE_KERNELS(generic, , 1, 0)
+#endif
+
+#ifdef BRAINWIRE_DISPATCH
+	BRAINWIRE_KERNELS(sse42, __attribute__((target("sse4.2,popcnt"))), 0, 1)
+	BRAINWIRE_KERNELS(bmi2, __attribute__((target("sse4.2,popcnt,bmi,bmi2,lzcnt"))), 1, 1)
+	BRAINWIRE_KERNELS(avx2, __attribute__((target("avx2,popcnt,bmi,bmi2,lzcnt"))), 1, 1)
+	BRAINWIRE_KERNELS(avx512, __attribute__((target("avx512f,avx512bw,avx512vl,popcnt,bmi,bmi2,lzcnt"))), 1, 1)
+#endif
+
+// Ordered from the least to the most capable
+static const brainwire_kernels_t brainwire_kernel_sets[] = {
+	BRAINWIRE_KERNEL_SET(generic, "generic"),
+	#ifdef BRAINWIRE_DISPATCH
+		BRAINWIRE_KERNEL_SET(sse42, "sse4.2"),
+		BRAINWIRE_KERNEL_SET(bmi2, "bmi2"),
+		BRAINWIRE_KERNEL_SET(avx2, "avx2"),
+		BRAINWIRE_KERNEL_SET(avx512, "avx512"),
+	#endif
+};
+
+#define BRAINWIRE_KERNEL_SETS (int)(sizeof(brainwire_kernel_sets) / sizeof(brainwire_kernel_sets[0]))
+
+static const brainwire_kernels_t *brainwire_kernels = NULL;
+
+static int brainwire_kernels_supported(int index) {
+	#ifdef BRAINWIRE_DISPATCH
+		__builtin_cpu_init();
+		int sse42 = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+		int bmi2 = sse42 && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") && 
+			__builtin_cpu_supports("lzcnt");
+		int avx2 = bmi2 && __builtin_cpu_supports("avx2");
+		int avx512 = avx2 && __builtin_cpu_supports("avx512f") && 
+			__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+		int supported[] = {1, sse42, bmi2, avx2, avx512};
+		return supported[index];
+	#else
+		return index == 0;
+	#endif
+}
+
+// Selects the kernel set by name, or the best supported one for NULL. 
+// Returns 0 if it is unknown or not supported by the CPU.
+int brainwire_kernels_select(const char *name) {
+	for (int i = BRAINWIRE_KERNEL_SETS - 1; i >= 0; i--) {
+		if ((!name || strcmp(name, brainwire_kernel_sets[i].name) == 0) && brainwire_kernels_supported(i)) {
+			brainwire_kernels = &brainwire_kernel_sets[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static const brainwire_kernels_t *brainwire_kernels_get(void) {
+	if (!brainwire_kernels) {
+		// An unknown or unsupported BRAINWIRE_ISA falls back to the best set;
+		// bwenc checks it up front
+		if (!brainwire_kernels_select(getenv("BRAINWIRE_ISA"))) {
+			brainwire_kernels_select(NULL);
+		}
+	}
+	return brainwire_kernels;
+}
+
+// Decodes the samples of s with the rice or, for BRAINWIRE_FLAG_TURBO, the
+// turbo sample loop
+static const char *brainwire_kernels_decode(const brainwire_kernels_t *kernels, brainwire_stream_t *s, void *sample_data) {
+	if (s->flags & BRAINWIRE_FLAG_TURBO) {
+		return kernels->decode_turbo(s, sample_data);
+	}
+	return kernels->decode_samples(s, sample_data);
+}
+
+static void *brainwire_decode_fail(void *sample_data, FILE *spikes_fh, const char *error) {
+	brainwire_free(sample_data);
+	if (spikes_fh) {
+		fclose(spikes_fh);
+	}
+	brainwire_error = error;
+	return NULL;
+}
+
+// Reads the header into s (from s->bytes, up to s->end bits) and sets 
+// s->bit_pos to the first sample. Returns NULL, or the error if the header is
+// malformed.
+static const char *brainwire_read_header(brainwire_stream_t *s) {
+	uint8_t *bytes = s->bytes;
+	int bit_pos = 0;
+
+	s->samples = rice_read(bytes, &bit_pos, 16);
+	s->samplerate = rice_read(bytes, &bit_pos, 16);
+	s->flags = 0;
+	s->mains_hz = 0;
+
+	if (s->samples == 0 && s->samplerate == BRAINWIRE_MAGIC) {
+		int version = rice_read(bytes, &bit_pos, 16);
+		if (version != BRAINWIRE_VERSION) {
+			return "Unsupported version";
+		}
+		s->flags = rice_read(bytes, &bit_pos, 16);
+		s->samples = rice_read(bytes, &bit_pos, 16);
+		s->samplerate = rice_read(bytes, &bit_pos, 16);
+		if (s->flags & BRAINWIRE_FLAG_HUM) {
+			s->mains_hz = rice_read(bytes, &bit_pos, 16);
+			if ((s->mains_hz != 50 && s->mains_hz != 60) || s->samplerate <= 0) {
+				return "Invalid mains frequency or samplerate";
+			}
+		}
+		if (s->flags & BRAINWIRE_FLAG_FRAMES) {
+			s->frame_len = rice_read(bytes, &bit_pos, 16);
+			if (
+				s->frame_len <= 0 || s->frame_len % BRAINWIRE_BLOCK != 0 || 
+				(s->flags & BRAINWIRE_FLAG_WAVELET)
+			) {
+				return "Invalid frame length";
+			}
+		}
+		if (
+			(s->flags & BRAINWIRE_FLAG_TURBO) && 
+			(s->flags & (BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_WAVELET | BRAINWIRE_FLAG_SPIKES))
+		) {
+			return "Invalid turbo flags";
+		}
+	}
+
+	// Every sample takes at least one bit, every turbo block 32. Progressive
+	// streams may be cut after the lowpass band, which has a coefficient per
+	// 2^BRAINWIRE_WAVELET_LEVELS samples.
+	int64_t max_samples = s->end;
+	if (s->flags & BRAINWIRE_FLAG_TURBO) {
+		max_samples = (s->end / 32 + 1) * BRAINWIRE_TURBO_LEN;
+	}
+	else if (s->flags & BRAINWIRE_FLAG_WAVELET) {
+		max_samples = s->end << BRAINWIRE_WAVELET_LEVELS;
+	}
+	if (s->samples < 0 || s->samples > max_samples || bit_pos > s->end) {
+		return "Invalid sample count";
+	}
+
+	if (s->flags & BRAINWIRE_FLAG_FRAMES) {
+		int64_t frames = ((int64_t)s->samples + s->frame_len - 1) / s->frame_len;
+		s->frames_pos = (bit_pos + 7) / 8;
+		if ((s->frames_pos + frames * 4) * 8 > s->end) {
+			return "Truncated frame table";
+		}
+		bit_pos = (s->frames_pos + frames * 4) * 8;
+	}
+	else if (s->flags & BRAINWIRE_FLAG_TURBO) {
+		bit_pos = (bit_pos + 7) & ~7;
+	}
+
+	if (s->flags & BRAINWIRE_FLAG_WAVELET) {
+		int levels = rice_read(bytes, &bit_pos, 16);
+		if (levels != BRAINWIRE_WAVELET_LEVELS) {
+			return "Unsupported wavelet levels";
+		}
+	}
+	s->bit_pos = bit_pos;
+	return NULL;
+}
+
+// Sets the decoder state in s to the start of the frame, from the frame table
+static const char *brainwire_frame_seek(brainwire_stream_t *s, int frame) {
+	uint32_t offset = brainwire_get_u32(s->bytes + s->frames_pos + frame * 4);
+	if (offset < (uint32_t)s->frames_pos || (int64_t)offset * 8 > s->end) {
+		return "Invalid frame offset";
+	}
+	s->bit_pos = offset * 8;
+	s->rice_k = 3;
+	s->prev_quantized = 0;
+	return NULL;
+}
+
+// Decodes the stream of size bytes, which has to be followed by 
+// BRAINWIRE_PADDING bytes of 0xff. Returns NULL and sets brainwire_error if 
+// the stream is malformed.
+void *brainwire_decode(uint8_t *bytes, int size, samples_t *desc, brainwire_opts_t *opts) {
+	brainwire_stream_t stream = {
+		.bytes = bytes,
+		.end = (int64_t)size * 8,
+		.rice_k = 3,
+		.opts = opts
+	};
+	const char *error = brainwire_read_header(&stream);
+	if (error) {
+		return brainwire_decode_fail(NULL, NULL, error);
+	}
+	int samples = stream.samples;
+	int samplerate = stream.samplerate;
+	int flags = stream.flags;
+	int sample_size = brainwire_sample_size(opts->format);
+	if (!sample_size) {
+		return brainwire_decode_fail(NULL, NULL, "Unsupported sample format");
+	}
+	uint8_t *sample_data = brainwire_malloc((size_t)samples * sample_size);
+	if (!sample_data) {
+		return brainwire_decode_fail(NULL, NULL, "Malloc failed");
+	}
+	stream.format = opts->format;
+
+	if (flags & BRAINWIRE_FLAG_WAVELET) {
+		if (opts->preview_level < 0 || opts->preview_level > BRAINWIRE_WAVELET_LEVELS) {
+			return brainwire_decode_fail(sample_data, NULL, "Preview level exceeds the wavelet levels");
+		}
+
+		int out_len = brainwire_wavelet_read(bytes, size, stream.bit_pos, sample_data, samples, opts->preview_level, opts->format);
+		if (out_len < 0) {
+			return brainwire_decode_fail(sample_data, NULL, brainwire_error);
+		}
+		desc->channels = 1;
+		desc->samples = out_len;
+		desc->samplerate = samplerate >> opts->preview_level;
+		return sample_data;
+	}
+	if (opts->preview_level != 0) {
+		return brainwire_decode_fail(sample_data, NULL, "Preview requires a progressive stream");
+	}
+
+	if (opts->spikes_path) {
+		if (!(flags & BRAINWIRE_FLAG_SPIKES)) {
+			return brainwire_decode_fail(sample_data, NULL, "Stream was not coded with spike templates");
+		}
+		stream.spikes_fh = fopen(opts->spikes_path, "w");
+		if (!stream.spikes_fh) {
+			return brainwire_decode_fail(sample_data, NULL, "Can't open the spikes file for writing");
+		}
+		fprintf(stream.spikes_fh, "sample,template\n");
+	}
+
+	// A framed stream is decoded frame by frame, each from its offset in the 
+	// frame table
+	const brainwire_kernels_t *kernels = brainwire_kernels_get();
+	int frame_len = (flags & BRAINWIRE_FLAG_FRAMES) ? stream.frame_len : samples;
+	for (int start = 0, frame = 0; start < samples; start += frame_len, frame++) {
+		if (flags & BRAINWIRE_FLAG_FRAMES) {
+			error = brainwire_frame_seek(&stream, frame);
+			if (error) {
+				return brainwire_decode_fail(sample_data, stream.spikes_fh, error);
+			}
+		}
+		stream.samples = samples - start < frame_len ? samples - start : frame_len;
+		stream.sample_offset = start;
+		error = brainwire_kernels_decode(kernels, &stream, sample_data + (size_t)start * sample_size);
+		if (error) {
+			return brainwire_decode_fail(sample_data, stream.spikes_fh, error);
+		}
+	}
+	if (stream.spikes_fh) {
+		fclose(stream.spikes_fh);
+	}
+
+	desc->channels = 1;
+	desc->samples = samples;
+	desc->samplerate = samplerate;
+	return sample_data;
+}
+
+uint8_t *brainwire_load(const char *path, int *size) {
+	FILE *fh = fopen(path, "rb");
+	if (!fh) {
+		brainwire_error = "Can't open file for reading";
+		return NULL;
+	}
+
+	fseek(fh, 0, SEEK_END);
+	long file_size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+
+	uint8_t *bytes = file_size > 0 && file_size < INT32_MAX - BRAINWIRE_PADDING 
+		? brainwire_malloc(file_size + BRAINWIRE_PADDING) 
+		: NULL;
+	int bytes_read = bytes ? fread(bytes, 1, file_size, fh) : 0;
+	fclose(fh);
+	if (bytes_read != file_size) {
+		brainwire_free(bytes);
+		brainwire_error = "Read failed";
+		return NULL;
+	}
+	memset(bytes + file_size, 0xff, BRAINWIRE_PADDING);
+	*size = file_size;
+	return bytes;
+}
+
+void *brainwire_read(const char *path, samples_t *desc, brainwire_opts_t *opts) {
+	BRAINWIRE_PROBE2(file_open, path, 0);
+	BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_PARSE);
+	int size;
+	uint8_t *bytes = brainwire_load(path, &size);
+	if (!bytes) {
+		return NULL;
+	}
+	BRAINWIRE_PERF_END(BRAINWIRE_PERF_PARSE);
+
+	void *sample_data = brainwire_decode(bytes, size, desc, opts);
+	brainwire_free(bytes);
+	BRAINWIRE_PROBE2(file_close, path, size);
+	return sample_data;
+}
+
+
+/* -----------------------------------------------------------------------------
+	Checkpoint index
+
+The v1 format has no sync points: every sample depends on bit_pos, rice_k and
+prev_quantized after the one before, so it can only be decoded serially from
+the start. The index records this state every interval samples, in one pass 
+over the stream, so that existing files can be decoded in parallel and from
+any checkpoint on, without rewriting them. Streams with hum predictor or spike
+templates carry more state and are not supported, unless they are framed: the
+frames of a framed stream start with a fresh state, so its index is read from
+the frame table instead, with a checkpoint per frame.
+
+The sidecar file (.bwi) is little endian: "BWIX", then the stream size in 
+bytes, the samples, the interval and the number of checkpoints as u32, then
+per checkpoint the bit position (u32), prev_quantized (i32) and the bits of 
+rice_k (u32). The stream size and sample count tie it to its stream. */
+
+#define BRAINWIRE_INDEX_HEADER_SIZE 20
+#define BRAINWIRE_INDEX_CHECKPOINT_SIZE 12
+
+static brainwire_index_t *brainwire_index_alloc(uint32_t count) {
+	brainwire_index_t *index = brainwire_malloc(sizeof(brainwire_index_t) + count * sizeof(brainwire_checkpoint_t));
+	if (!index) {
+		brainwire_error = "Malloc failed";
+		return NULL;
+	}
+	index->count = count;
+	return index;
+}
+
+// Reads the header of the v1 or framed stream into s. Returns NULL, or the
+// error.
+static const char *brainwire_index_header(brainwire_stream_t *s) {
+	const char *error = brainwire_read_header(s);
+	if (error) {
+		return error;
+	}
+	if (s->flags && !(s->flags & BRAINWIRE_FLAG_FRAMES)) {
+		return "Checkpoint index requires a v1 or framed stream";
+	}
+	return NULL;
+}
+
+brainwire_index_t *brainwire_index(uint8_t *bytes, int size, int interval) {
+	brainwire_opts_t opts = {0};
+	brainwire_stream_t stream = {
+		.bytes = bytes,
+		.end = (int64_t)size * 8,
+		.rice_k = 3,
+		.opts = &opts
+	};
+	const char *error = brainwire_index_header(&stream);
+	if (error || interval <= 0) {
+		brainwire_error = error ? error : "Invalid checkpoint interval";
+		return NULL;
+	}
+	interval = (interval + BRAINWIRE_BLOCK - 1) / BRAINWIRE_BLOCK * BRAINWIRE_BLOCK;
+	if (stream.flags & BRAINWIRE_FLAG_FRAMES) {
+		interval = stream.frame_len;
+	}
+
+	int samples = stream.samples;
+	brainwire_index_t *index = brainwire_index_alloc((samples + (int64_t)interval - 1) / interval);
+	if (!index) {
+		return NULL;
+	}
+	index->size = size;
+	index->samples = samples;
+	index->interval = interval;
+
+	const brainwire_kernels_t *kernels = brainwire_kernels_get();
+	for (int c = 0; c < (int)index->count; c++) {
+		brainwire_checkpoint_t *cp = &index->checkpoints[c];
+		if (stream.flags & BRAINWIRE_FLAG_FRAMES) {
+			error = brainwire_frame_seek(&stream, c);
+			if (error) {
+				brainwire_free(index);
+				brainwire_error = error;
+				return NULL;
+			}
+		}
+		cp->bit_pos = stream.bit_pos;
+		cp->prev_quantized = stream.prev_quantized;
+		memcpy(&cp->rice_k, &stream.rice_k, sizeof(float));
+
+		if (stream.flags & BRAINWIRE_FLAG_FRAMES) {
+			continue;
+		}
+		int remaining = samples - c * interval;
+		stream.samples = remaining < interval ? remaining : interval;
+		error = brainwire_kernels_decode(kernels, &stream, NULL);
+		if (error) {
+			brainwire_free(index);
+			brainwire_error = error;
+			return NULL;
+		}
+	}
+	return index;
+}
+
+int brainwire_index_write(const char *path, brainwire_index_t *index) {
+	int size = BRAINWIRE_INDEX_HEADER_SIZE + index->count * BRAINWIRE_INDEX_CHECKPOINT_SIZE;
+	uint8_t *bytes = brainwire_malloc(size);
+	if (!bytes) {
+		brainwire_error = "Malloc failed";
+		return 0;
+	}
+
+	memcpy(bytes, "BWIX", 4);
+	brainwire_put_u32(bytes + 4, index->size);
+	brainwire_put_u32(bytes + 8, index->samples);
+	brainwire_put_u32(bytes + 12, index->interval);
+	brainwire_put_u32(bytes + 16, index->count);
+	for (uint32_t c = 0; c < index->count; c++) {
+		uint8_t *p = bytes + BRAINWIRE_INDEX_HEADER_SIZE + c * BRAINWIRE_INDEX_CHECKPOINT_SIZE;
+		brainwire_put_u32(p + 0, index->checkpoints[c].bit_pos);
+		brainwire_put_u32(p + 4, index->checkpoints[c].prev_quantized);
+		brainwire_put_u32(p + 8, index->checkpoints[c].rice_k);
+	}
+
+	FILE *fh = fopen(path, "wb");
+	int ok = fh && fwrite(bytes, 1, size, fh) == (size_t)size;
+	if (fh) {
+		ok &= fclose(fh) == 0;
+	}
+	brainwire_free(bytes);
+	if (!ok) {
+		brainwire_error = fh ? "Write error" : "Can't open file for writing";
+		return 0;
+	}
+	return size;
+}
+
+// The checkpoints themselves are checked when they are used, see 
+// brainwire_decode_range()
+brainwire_index_t *brainwire_index_read(const char *path) {
+	FILE *fh = fopen(path, "rb");
+	if (!fh) {
+		brainwire_error = "Can't open file for reading";
+		return NULL;
+	}
+
+	uint8_t header[BRAINWIRE_INDEX_HEADER_SIZE];
+	brainwire_index_t *index = NULL;
+	if (fread(header, sizeof(header), 1, fh) != 1 || memcmp(header, "BWIX", 4) != 0) {
+		brainwire_error = "Not a checkpoint index";
+	}
+	else {
+		uint32_t samples = brainwire_get_u32(header + 8);
+		uint32_t interval = brainwire_get_u32(header + 12);
+		uint32_t count = brainwire_get_u32(header + 16);
+		if (
+			interval == 0 || interval % BRAINWIRE_BLOCK != 0 || samples > INT32_MAX ||
+			count != (samples + (uint64_t)interval - 1) / interval
+		) {
+			brainwire_error = "Invalid checkpoint index";
+		}
+		else if ((index = brainwire_index_alloc(count))) {
+			index->size = brainwire_get_u32(header + 4);
+			index->samples = samples;
+			index->interval = interval;
+			for (uint32_t c = 0; c < count && index; c++) {
+				uint8_t p[BRAINWIRE_INDEX_CHECKPOINT_SIZE];
+				if (fread(p, sizeof(p), 1, fh) != 1) {
+					brainwire_free(index);
+					index = NULL;
+					brainwire_error = "Truncated checkpoint index";
+					break;
+				}
+				index->checkpoints[c].bit_pos = brainwire_get_u32(p + 0);
+				index->checkpoints[c].prev_quantized = brainwire_get_u32(p + 4);
+				index->checkpoints[c].rice_k = brainwire_get_u32(p + 8);
+			}
+		}
+	}
+	fclose(fh);
+	return index;
+}
+
+int brainwire_decode_range(uint8_t *bytes, int size, brainwire_index_t *index, int first, int count, short *sample_data) {
+	brainwire_opts_t opts = {0};
+	brainwire_stream_t stream = {
+		.bytes = bytes,
+		.end = (int64_t)size * 8,
+		.opts = &opts
+	};
+	const char *error = brainwire_index_header(&stream);
+	if (error) {
+		brainwire_error = error;
+		return 0;
+	}
+	int samples = stream.samples;
+	if (
+		index->size != (uint32_t)size || index->samples != (uint32_t)samples ||
+		((stream.flags & BRAINWIRE_FLAG_FRAMES) && index->interval != (uint32_t)stream.frame_len)
+	) {
+		brainwire_error = "Checkpoint index doesn't match the stream";
+		return 0;
+	}
+	if (first < 0 || count < 0 || first > samples - count) {
+		brainwire_error = "Range exceeds the stream";
+		return 0;
+	}
+
+	// From each checkpoint, the samples up to first are decoded without being
+	// reconstructed, then the range up to the next checkpoint. A frame has to
+	// be decoded in one go, since the hum predictor and spike templates carry
+	// state from sample to sample, too.
+	const brainwire_kernels_t *kernels = brainwire_kernels_get();
+	int interval = index->interval;
+	for (int pos = first / interval * interval; pos < first + count; pos += interval) {
+		// The checkpoint comes from a file; a rice_k out of range would be 
+		// undefined when converted to the rice coder's k, a prev_quantized out
+		// of range could overflow
+		brainwire_checkpoint_t *cp = &index->checkpoints[pos / interval];
+		memcpy(&stream.rice_k, &cp->rice_k, sizeof(float));
+		if (
+			cp->bit_pos > stream.end || cp->prev_quantized < -32768 || cp->prev_quantized > 32767 ||
+			!(stream.rice_k >= 0 && stream.rice_k < 65536)
+		) {
+			brainwire_error = "Invalid checkpoint";
+			return 0;
+		}
+		stream.bit_pos = cp->bit_pos;
+		stream.prev_quantized = cp->prev_quantized;
+
+		int end = first + count - pos < interval ? first + count - pos : interval;
+		stream.skip = first > pos ? first - pos : 0;
+		stream.samples = end;
+		stream.sample_offset = pos;
+		error = brainwire_kernels_decode(kernels, &stream, sample_data + pos + stream.skip - first);
+		if (error) {
+			brainwire_error = error;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/* -----------------------------------------------------------------------------
+	Packed 10 bit files
+
+.bw10 is "BW10", then the samplerate and the number of samples as u32 little
+endian, then the codes of brainwire_quant() + 512 at 10 bits each, least 
+significant bit first (see "Sample loops" for the packing). Since the codes
+carry all the information of the samples, this is 1.6x smaller than 16 bit
+WAV, at about the cost of copying. */
+
+#define BRAINWIRE_BW10_SIZE(SAMPLES) (BRAINWIRE_BW10_HEADER_SIZE + ((int64_t)(SAMPLES) * 10 + 7) / 8)
+
+int brainwire_bw10_decode(uint8_t *bytes, int size, samples_t *desc, int first, int count, void *out, int format) {
+	desc->channels = 1;
+	desc->samplerate = size >= BRAINWIRE_BW10_HEADER_SIZE ? brainwire_get_u32(bytes + 4) : 0;
+	desc->samples = size >= BRAINWIRE_BW10_HEADER_SIZE ? brainwire_get_u32(bytes + 8) : 0;
+	if (
+		size < BRAINWIRE_BW10_HEADER_SIZE || memcmp(bytes, "BW10", 4) != 0 || 
+		desc->samples > INT32_MAX || BRAINWIRE_BW10_SIZE(desc->samples) != size
+	) {
+		brainwire_error = "Not a .bw10 file";
+		return 0;
+	}
+	if (!brainwire_sample_size(format)) {
+		brainwire_error = "Unsupported sample format";
+		return 0;
+	}
+	if (first < 0 || count < 0 || first > (int)desc->samples - count) {
+		brainwire_error = "Range exceeds the file";
+		return 0;
+	}
+	brainwire_kernels_get()->unpack10(bytes + BRAINWIRE_BW10_HEADER_SIZE, first, count, out, format);
+	return 1;
+}
+
+void *brainwire_bw10_read(const char *path, samples_t *desc, brainwire_opts_t *opts) {
+	int size;
+	uint8_t *bytes = brainwire_load(path, &size);
+	if (!bytes) {
+		return NULL;
+	}
+
+	// The sample count is checked against the file size first
+	samples_t header;
+	void *sample_data = NULL;
+	if (brainwire_bw10_decode(bytes, size, &header, 0, 0, NULL, opts->format)) {
+		sample_data = brainwire_malloc((size_t)header.samples * brainwire_sample_size(opts->format));
+		if (sample_data) {
+			brainwire_bw10_decode(bytes, size, desc, 0, header.samples, sample_data, opts->format);
+		}
+		else {
+			brainwire_error = "Malloc failed";
+		}
+	}
+	brainwire_free(bytes);
+	return sample_data;
+}
+
+#ifndef BRAINWIRE_NO_ENCODER
+
+// Whether all codes are within the 10 bits of brainwire_quant()
+static int brainwire_codes_in_range(const short *codes, int samples) {
+	int in_range = 1;
+	for (int i = 0; i < samples; i++) {
+		in_range &= codes[i] >= -512 && codes[i] < 512;
+	}
+	return in_range;
+}
+
+int brainwire_bw10_write(const char *path, short *sample_data, samples_t *desc, brainwire_opts_t *opts) {
+	int samples = desc->samples;
+	if (opts->format != BRAINWIRE_FORMAT_S16 && opts->format != BRAINWIRE_FORMAT_CODES) {
+		brainwire_error = "Unsupported sample format";
+		return 0;
+	}
+	if (BRAINWIRE_BW10_SIZE(samples) > INT32_MAX - 16) {
+		brainwire_error = "Too many samples";
+		return 0;
+	}
+	if (opts->format == BRAINWIRE_FORMAT_CODES && !brainwire_codes_in_range(sample_data, samples)) {
+		brainwire_error = "Codes exceed 10 bits";
+		return 0;
+	}
+
+	// The SIMD packing stores 16 bytes per group of 10
+	int size = BRAINWIRE_BW10_SIZE(samples);
+	uint8_t *bytes = brainwire_calloc(size + 16, 1);
+	if (!bytes) {
+		brainwire_error = "Malloc failed";
+		return 0;
+	}
+	memcpy(bytes, "BW10", 4);
+	brainwire_put_u32(bytes + 4, desc->samplerate);
+	brainwire_put_u32(bytes + 8, samples);
+	brainwire_kernels_get()->pack10(bytes + BRAINWIRE_BW10_HEADER_SIZE, sample_data, samples, opts->format);
+
+	FILE *fh = fopen(path, "wb");
+	int ok = fh && fwrite(bytes, 1, size, fh) == (size_t)size;
+	if (fh) {
+		ok &= fclose(fh) == 0;
+	}
+	brainwire_free(bytes);
+	if (!ok) {
+		brainwire_error = fh ? "Write error" : "Can't open file for writing";
+		return 0;
+	}
+	return size;
+}
+
+// Encodes the stream for brainwire_encode(). If it would take more than 
+// max_len bytes, it may give up and return NULL, but the sample loop only 
+// checks this when the buffer would grow; the buffer is allocated at no more
+// than max_len + BRAINWIRE_MAX_SAMPLE_BYTES bytes, so that it doesn't.
+static uint8_t *brainwire_encode_stream(short *sample_data, samples_t *desc, brainwire_opts_t *opts, int max_len, int *out_len) {
+	int bit_pos = 0;
+	int flags = opts->flags;
+	int mains_hz = opts->mains_hz;
+	int samples = desc->samples;
+	if ((flags & (BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES | BRAINWIRE_FLAG_FRAMES)) && (flags & BRAINWIRE_FLAG_WAVELET)) {
+		brainwire_error = "Hum predictor, spike templates and frames not supported in progressive mode";
+		return NULL;
+	}
+	if ((flags & BRAINWIRE_FLAG_TURBO) && (flags & (BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES | BRAINWIRE_FLAG_WAVELET))) {
+		brainwire_error = "Hum predictor, spike templates and progressive mode not supported in turbo mode";
+		return NULL;
+	}
+	if (opts->format != BRAINWIRE_FORMAT_S16 && opts->format != BRAINWIRE_FORMAT_CODES) {
+		brainwire_error = "Unsupported sample format";
+		return NULL;
+	}
+
+	// The longest codes the buffers are grown by, and the turbo block widths,
+	// are bounds for 10 bit codes. Codes decoded from legacy streams may not
+	// be within them.
+	if (opts->format == BRAINWIRE_FORMAT_CODES && !brainwire_codes_in_range(sample_data, samples)) {
+		brainwire_error = "Codes exceed 10 bits";
+		return NULL;
+	}
+
+	// Without frames, the whole stream is coded as one frame
+	int frame_len = samples;
+	int frames = 1;
+	if (flags & BRAINWIRE_FLAG_FRAMES) {
+		frame_len = opts->frame_len ? opts->frame_len : BRAINWIRE_FRAME_LEN;
+		if (frame_len <= 0 || frame_len % BRAINWIRE_BLOCK != 0) {
+			brainwire_error = "Invalid frame length";
+			return NULL;
+		}
+		frames = (samples + frame_len - 1) / frame_len;
+	}
+
+	// Each frame table entry takes 4 bytes, plus up to 1 for the alignment.
+	// Turbo blocks take less than 2 bytes per sample, but each frame may end
+	// with a partial one. Rice codes usually take less than 2 bytes per sample
+	// too; the sample loop grows the buffer for those that don't.
+	int size = samples * 2 + 64 + frames * 5;
+	if (flags & BRAINWIRE_FLAG_TURBO) {
+		size += frames * BRAINWIRE_TURBO_MAX_BYTES;
+	}
+	if (size > (int64_t)max_len + BRAINWIRE_MAX_SAMPLE_BYTES) {
+		size = max_len + BRAINWIRE_MAX_SAMPLE_BYTES;
+	}
+	uint8_t *bytes = brainwire_malloc(size + BRAINWIRE_PADDING);
+	if (!bytes) {
+		brainwire_error = "Malloc failed";
+		return NULL;
+	}
+	memset(bytes, 0, size);
+
+	// The verification in the sample loop reads up to the encoder's position
+	// and relies on the padding, like the decoder
+	memset(bytes + size, 0xff, BRAINWIRE_PADDING);
+
+	if (flags) {
+		rice_write(bytes, &bit_pos, 0, 16);
+		rice_write(bytes, &bit_pos, BRAINWIRE_MAGIC, 16);
+		rice_write(bytes, &bit_pos, BRAINWIRE_VERSION, 16);
+		rice_write(bytes, &bit_pos, flags, 16);
+	}
+	rice_write(bytes, &bit_pos, desc->samples, 16);
+	rice_write(bytes, &bit_pos, desc->samplerate, 16);
+	if (flags & BRAINWIRE_FLAG_HUM) {
+		rice_write(bytes, &bit_pos, mains_hz, 16);
+	}
+	if (flags & BRAINWIRE_FLAG_FRAMES) {
+		rice_write(bytes, &bit_pos, frame_len, 16);
+	}
+
+	if (flags & BRAINWIRE_FLAG_WAVELET) {
+		rice_write(bytes, &bit_pos, BRAINWIRE_WAVELET_LEVELS, 16);
+		bit_pos = brainwire_wavelet_write(&bytes, &size, bit_pos, sample_data, samples, opts->format);
+		if (bit_pos < 0) {
+			brainwire_free(bytes);
+			return NULL;
+		}
+	}
+
+	// The frame table is filled in as the frames are written
+	int frames_pos = (bit_pos + 7) / 8;
+	if (flags & BRAINWIRE_FLAG_FRAMES) {
+		bit_pos = (frames_pos + frames * 4) * 8;
+	}
+	else if (flags & BRAINWIRE_FLAG_TURBO) {
+		bit_pos = frames_pos * 8;
+	}
+
+	// With verify, the header is read back as the decoder would and the
+	// sample loop starts its decoder where this says the samples are.
+	// Progressive and turbo streams are decoded as a whole afterwards.
+	brainwire_stream_t check = {.bytes = bytes, .end = (int64_t)size * 8};
+	int mismatch = -1;
+	if (opts->verify && !(flags & BRAINWIRE_FLAG_WAVELET) && (
+		brainwire_read_header(&check) ||
+		check.samples != (int)desc->samples || check.samplerate != (int)desc->samplerate ||
+		check.flags != flags || check.mains_hz != (flags & BRAINWIRE_FLAG_HUM ? mains_hz : 0) ||
+		check.frame_len != (flags & BRAINWIRE_FLAG_FRAMES ? frame_len : 0) ||
+		check.bit_pos != bit_pos
+	)) {
+		mismatch = 0;
+	}
+
+	// Frames start byte aligned and with a fresh encoder state, so that each 
+	// can be decoded on its own
+	const brainwire_kernels_t *kernels = brainwire_kernels_get();
+	for (int frame = 0; frame < frames && !(flags & BRAINWIRE_FLAG_WAVELET) && mismatch < 0; frame++) {
+		int start = frame * frame_len;
+		int verify_pos = opts->verify ? check.bit_pos : -1;
+		if (flags & BRAINWIRE_FLAG_FRAMES) {
+			bit_pos = (bit_pos + 7) & ~7;
+			brainwire_put_u32(bytes + frames_pos + frame * 4, bit_pos / 8);
+			if (opts->verify) {
+				verify_pos = brainwire_get_u32(bytes + check.frames_pos + frame * 4) * 8;
+			}
+		}
+		brainwire_stream_t stream = {
+			.bytes = bytes,
+			.bit_pos = bit_pos,
+			.samples = samples - start < frame_len ? samples - start : frame_len,
+			.samplerate = desc->samplerate,
+			.flags = flags,
+			.mains_hz = mains_hz,
+			.format = opts->format,
+			.end = (int64_t)size * 8,
+			.sample_offset = start,
+			.verify_pos = verify_pos,
+			.mismatch = -1,
+			.max_pos = (int64_t)max_len * 8,
+			.opts = opts
+		};
+		if (flags & BRAINWIRE_FLAG_TURBO) {
+			stream.bit_pos = brainwire_turbo_encode(bytes, bit_pos / 8, sample_data + start, stream.samples, opts->format) * 8;
+		}
+		else {
+			kernels->encode_samples(&stream, sample_data + start);
+			bytes = stream.bytes;
+			size = (int)(stream.end / 8);
+			if (stream.bit_pos < 0) {
+				brainwire_free(bytes);
+				return NULL;
+			}
+		}
+		bit_pos = stream.bit_pos;
+		if (stream.mismatch >= 0) {
+			mismatch = start + stream.mismatch;
+		}
+	}
+
+	*out_len = (bit_pos + 7) / 8;
+	memset(bytes + *out_len, 0xff, BRAINWIRE_PADDING);
+
+	if (opts->verify && (flags & (BRAINWIRE_FLAG_WAVELET | BRAINWIRE_FLAG_TURBO)) && mismatch < 0) {
+		brainwire_opts_t decode_opts = {.format = opts->format};
+		samples_t decoded_desc;
+		short *decoded = brainwire_decode(bytes, *out_len, &decoded_desc, &decode_opts);
+		mismatch = !decoded || decoded_desc.samples != desc->samples
+			? 0
+			: brainwire_compare(decoded, sample_data, desc->samples);
+		brainwire_free(decoded);
+	}
+
+	if (mismatch >= 0) {
+		static char error[64];
+		snprintf(error, sizeof(error), "Verification failed at sample %d", mismatch);
+		brainwire_error = error;
+		brainwire_free(bytes);
+		return NULL;
+	}
+	return bytes;
+}
+
+// The hum predictor costs a little where there is not much hum to predict,
+// see "Mains hum" in the README. So with BRAINWIRE_FLAG_HUM, the samples are
+// also coded without it, and the smaller stream is returned. The first 
+// stream is shrunk to its length, and the trial without the predictor gives
+// up once it is longer, so that both together take little more than one 
+// buffer. The perf hook, the latency histograms and the stats only see the 
+// encode with the predictor; the probes see both.
+uint8_t *brainwire_encode(short *sample_data, samples_t *desc, brainwire_opts_t *opts, int *out_len) {
+	uint8_t *bytes = brainwire_encode_stream(sample_data, desc, opts, INT32_MAX, out_len);
+	if (!bytes || !(opts->flags & BRAINWIRE_FLAG_HUM)) {
+		return bytes;
+	}
+	uint8_t *shrunk = brainwire_realloc(bytes, *out_len + BRAINWIRE_PADDING);
+	bytes = shrunk ? shrunk : bytes;
+
+	brainwire_opts_t trial_opts = *opts;
+	trial_opts.flags &= ~BRAINWIRE_FLAG_HUM;
+	trial_opts.stats = NULL;
+	void (*perf_hook)(int stage, int begin) = brainwire_perf_hook;
+	brainwire_perf_hook = NULL;
+	#ifdef BRAINWIRE_LATENCY
+		brainwire_latency_t latency = brainwire_latency[BRAINWIRE_LATENCY_ENCODE];
+	#endif
+	const char *error = brainwire_error;
+
+	int trial_len;
+	uint8_t *trial = brainwire_encode_stream(sample_data, desc, &trial_opts, *out_len, &trial_len);
+
+	brainwire_perf_hook = perf_hook;
+	#ifdef BRAINWIRE_LATENCY
+		brainwire_latency[BRAINWIRE_LATENCY_ENCODE] = latency;
+	#endif
+	brainwire_error = error;
+
+	// A trial that failed, e.g. out of memory, just keeps the predictor
+	if (trial && trial_len <= *out_len) {
+		brainwire_free(bytes);
+		*out_len = trial_len;
+		return trial;
+	}
+	brainwire_free(trial);
+	return bytes;
+}
+
+int brainwire_write(const char *path, short *sample_data, samples_t *desc, brainwire_opts_t *opts) {
+	BRAINWIRE_PROBE2(file_open, path, 1);
+	int byte_len;
+	uint8_t *bytes = brainwire_encode(sample_data, desc, opts, &byte_len);
+	if (!bytes) {
+		return 0;
+	}
+
+	BRAINWIRE_PERF_BEGIN(BRAINWIRE_PERF_WRITE);
+	FILE *fh = fopen(path, "wb");
+	int ok = fh && fwrite(bytes, 1, byte_len, fh) == (size_t)byte_len;
+	if (fh) {
+		ok &= fclose(fh) == 0;
+	}
+	BRAINWIRE_PERF_END(BRAINWIRE_PERF_WRITE);
+	brainwire_free(bytes);
+
+	BRAINWIRE_PROBE2(file_close, path, byte_len);
+	if (!ok) {
+		brainwire_error = fh ? "Write error" : "Can't open file for writing";
+		return 0;
+	}
+	return byte_len;
+}
+
+#endif // BRAINWIRE_NO_ENCODER
+
+#endif // BRAINWIRE_IMPLEMENTATION
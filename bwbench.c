@@ -0,0 +1,484 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+Microbenchmarks for the brainwire kernels
+
+Compile with:
+	gcc bwbench.c -std=c99 -lm -O3 -o bwbench
+
+Usage:
+	./bwbench
+	./bwbench [-n 50|60] [-w] [-s] [--turbo] [--frames samples] in1.wav in2.wav ... > corpus.json
+
+Without arguments, times rice_write, rice_read, their word-wise variants
+rice_write_word and rice_read_word, brainwire_quant and brainwire_dequant in
+isolation. The rice kernels are run for each k with laplacian residuals
+scaled to that k, and with the "adaptive" residuals and k trajectory of a
+synthetic recording. Each kernel is run BENCH_WARMUP times untimed, then
+BENCH_RUNS times timed. Reported are median and min ns/sample, throughput in
+MB/s of 16 bit samples, cycles/sample (x86 only) and the relative standard
+deviation over all runs.
+
+With a list of WAV files, runs the corpus benchmark instead: all files are 
+loaded once, then encoded and decoded in memory BENCH_CORPUS_RUNS times each
+with the given bwenc options. The decoded samples are checked to be 
+bit-exact. Per file and aggregate ratio, MB/s and samples/s (median run) are
+written to stdout as JSON, along with the files whose ratio or throughput is
+below BENCH_OUTLIER_FACTOR times the median of all files. Compiled with
+-DBRAINWIRE_LATENCY, the JSON also contains the per-sample cycle percentiles
+of the encoder and decoder over the whole corpus.
+
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#define BWENC_NO_MAIN
+#include "bwenc.c"
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define BENCH_CYCLES() __rdtsc()
+#else
+	#define BENCH_CYCLES() 0
+#endif
+
+#define BENCH_SAMPLES (1 << 20)
+#define BENCH_WARMUP 3
+#define BENCH_RUNS 15
+#define BENCH_MAX_K 16
+#define BENCH_CORPUS_RUNS 5
+#define BENCH_OUTLIER_FACTOR 0.67
+
+typedef struct {
+	double ns[BENCH_RUNS];
+	double cycles[BENCH_RUNS];
+} bench_result_t;
+
+static volatile int bench_sink;
+
+static uint64_t bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_cmp_double(const void *a, const void *b) {
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+// Deterministic xorshift, so that runs are comparable
+static uint32_t bench_rand_state = 0x9e3779b9;
+static uint32_t bench_rand(void) {
+	uint32_t x = bench_rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return bench_rand_state = x;
+}
+
+// Laplacian distributed residual with mean magnitude of roughly scale
+static int bench_laplace(double scale) {
+	double u = (bench_rand() + 1.0) / 4294967297.0;
+	int mag = (int)(-log(u) * scale);
+	return (bench_rand() & 1) ? mag : -mag - 1;
+}
+
+static void bench_report(const char *name, const char *k_str, bench_result_t *r) {
+	double ns[BENCH_RUNS];
+	double cycles[BENCH_RUNS];
+	double mean = 0;
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		ns[i] = r->ns[i] / BENCH_SAMPLES;
+		cycles[i] = r->cycles[i] / BENCH_SAMPLES;
+		mean += ns[i];
+	}
+	mean /= BENCH_RUNS;
+
+	double var = 0;
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		var += (ns[i] - mean) * (ns[i] - mean);
+	}
+	double rsd = sqrt(var / BENCH_RUNS) / mean * 100.0;
+
+	qsort(ns, BENCH_RUNS, sizeof(double), bench_cmp_double);
+	qsort(cycles, BENCH_RUNS, sizeof(double), bench_cmp_double);
+	double median = ns[BENCH_RUNS / 2];
+
+	printf(
+		"%-15s %5s %10.3f %10.3f %10.1f %10.2f %7.2f%%\n",
+		name, k_str, median, ns[0], (sizeof(short) * 1000.0) / median,
+		cycles[BENCH_RUNS / 2], rsd
+	);
+}
+
+#define BENCH_RUN(RESULT, SETUP, BODY) \
+	for (int run = -BENCH_WARMUP; run < BENCH_RUNS; run++) { \
+		SETUP; \
+		uint64_t t0 = bench_ns(); \
+		uint64_t c0 = BENCH_CYCLES(); \
+		BODY; \
+		uint64_t c1 = BENCH_CYCLES(); \
+		uint64_t t1 = bench_ns(); \
+		if (run >= 0) { \
+			(RESULT)->ns[run] = t1 - t0; \
+			(RESULT)->cycles[run] = c1 - c0; \
+		} \
+	}
+
+// Time rice_write and rice_read, and the word-wise rice_write_word and 
+// rice_read_word, over the given residuals. If ks is NULL, k is used for all
+// residuals
+static void bench_rice(int *residuals, uint8_t *ks, int k, uint8_t *bytes, int bytes_size) {
+	bench_result_t result;
+	char k_str[8] = "adapt";
+	int bit_pos = 0;
+	int sum = 0;
+
+	BENCH_RUN(&result,
+		memset(bytes, 0, bytes_size); bit_pos = 0,
+		for (int i = 0; i < BENCH_SAMPLES; i++) {
+			sum += rice_write(bytes, &bit_pos, residuals[i], ks ? ks[i] : k);
+		}
+	);
+	if (!ks) {
+		snprintf(k_str, sizeof(k_str), "%d", k);
+	}
+	bench_report("rice_write", k_str, &result);
+
+	BENCH_RUN(&result,
+		bit_pos = 0,
+		for (int i = 0; i < BENCH_SAMPLES; i++) {
+			sum += rice_read(bytes, &bit_pos, ks ? ks[i] : k);
+		}
+	);
+	bench_report("rice_read", k_str, &result);
+
+	// Verify the round trip, so we never benchmark a broken kernel
+	bit_pos = 0;
+	for (int i = 0; i < BENCH_SAMPLES; i++) {
+		int v = rice_read(bytes, &bit_pos, ks ? ks[i] : k);
+		ASSERT(v == residuals[i], "rice round trip mismatch at %d", i);
+	}
+
+	BENCH_RUN(&result,
+		memset(bytes, 0, bytes_size); bit_pos = 0,
+		for (int i = 0; i < BENCH_SAMPLES; i++) {
+			sum += rice_write_word(bytes, &bit_pos, residuals[i], ks ? ks[i] : k);
+		}
+	);
+	bench_report("rice_write_word", k_str, &result);
+
+	BENCH_RUN(&result,
+		bit_pos = 0,
+		for (int i = 0; i < BENCH_SAMPLES; i++) {
+			sum += rice_read_word(bytes, &bit_pos, ks ? ks[i] : k);
+		}
+	);
+	bench_report("rice_read_word", k_str, &result);
+
+	bit_pos = 0;
+	for (int i = 0; i < BENCH_SAMPLES; i++) {
+		int v = rice_read_word(bytes, &bit_pos, ks ? ks[i] : k);
+		ASSERT(v == residuals[i], "word-wise rice round trip mismatch at %d", i);
+	}
+	bench_sink = sum;
+}
+
+typedef struct {
+	const char *path;
+	short *sample_data;
+	samples_t desc;
+	int raw_bytes;
+	int compressed_bytes;
+	double encode_ns;
+	double decode_ns;
+} bench_file_t;
+
+static double bench_median(double *v, int len) {
+	qsort(v, len, sizeof(double), bench_cmp_double);
+	return v[len / 2];
+}
+
+static void bench_json_str(const char *s) {
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			putchar('\\');
+		}
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+static void bench_json_stats(bench_file_t *f) {
+	double bytes = f->desc.samples * f->desc.channels * sizeof(short);
+	double samples = f->desc.samples * f->desc.channels;
+	printf(
+		"\"samples\": %.0f, \"raw_bytes\": %d, \"compressed_bytes\": %d, "
+		"\"ratio\": %.4f, \"encode_ms\": %.3f, \"decode_ms\": %.3f, "
+		"\"encode_mb_s\": %.2f, \"decode_mb_s\": %.2f, "
+		"\"encode_samples_s\": %.0f, \"decode_samples_s\": %.0f",
+		samples, f->raw_bytes, f->compressed_bytes,
+		(double)f->raw_bytes / f->compressed_bytes,
+		f->encode_ns / 1e6, f->decode_ns / 1e6,
+		bytes * 1000.0 / f->encode_ns, bytes * 1000.0 / f->decode_ns,
+		samples * 1e9 / f->encode_ns, samples * 1e9 / f->decode_ns
+	);
+}
+
+static void bench_corpus(char **paths, int num_files, brainwire_opts_t *opts) {
+	bench_file_t *files = malloc(num_files * sizeof(bench_file_t));
+
+	for (int i = 0; i < num_files; i++) {
+		bench_file_t *f = &files[i];
+		f->path = paths[i];
+		f->sample_data = wav_read(f->path, &f->desc);
+		ASSERT(f->sample_data, "Can't load %s", f->path);
+
+		FILE *fh = fopen(f->path, "rb");
+		fseek(fh, 0, SEEK_END);
+		f->raw_bytes = ftell(fh);
+		fclose(fh);
+	}
+
+	for (int i = 0; i < num_files; i++) {
+		bench_file_t *f = &files[i];
+		double encode_ns[BENCH_CORPUS_RUNS];
+		double decode_ns[BENCH_CORPUS_RUNS];
+
+		for (int run = 0; run < BENCH_CORPUS_RUNS; run++) {
+			uint64_t t0 = bench_ns();
+			uint8_t *bytes = brainwire_encode(f->sample_data, &f->desc, opts, &f->compressed_bytes);
+			uint64_t t1 = bench_ns();
+			ASSERT(bytes, "Can't encode %s: %s", f->path, brainwire_error);
+
+			samples_t desc;
+			short *decoded = brainwire_decode(bytes, f->compressed_bytes, &desc, opts);
+			uint64_t t2 = bench_ns();
+
+			ASSERT(
+				decoded && desc.samples == f->desc.samples && 
+				memcmp(decoded, f->sample_data, desc.samples * sizeof(short)) == 0,
+				"%s does not round trip", f->path
+			);
+			brainwire_free(bytes);
+			brainwire_free(decoded);
+
+			encode_ns[run] = t1 - t0;
+			decode_ns[run] = t2 - t1;
+		}
+		f->encode_ns = bench_median(encode_ns, BENCH_CORPUS_RUNS);
+		f->decode_ns = bench_median(decode_ns, BENCH_CORPUS_RUNS);
+	}
+
+	bench_file_t total = {0};
+	double *ratios = malloc(num_files * sizeof(double));
+	double *encode_mb_s = malloc(num_files * sizeof(double));
+	double *decode_mb_s = malloc(num_files * sizeof(double));
+	for (int i = 0; i < num_files; i++) {
+		bench_file_t *f = &files[i];
+		total.desc.channels = 1;
+		total.desc.samples += f->desc.samples * f->desc.channels;
+		total.raw_bytes += f->raw_bytes;
+		total.compressed_bytes += f->compressed_bytes;
+		total.encode_ns += f->encode_ns;
+		total.decode_ns += f->decode_ns;
+		ratios[i] = (double)f->raw_bytes / f->compressed_bytes;
+		encode_mb_s[i] = f->raw_bytes / f->encode_ns;
+		decode_mb_s[i] = f->raw_bytes / f->decode_ns;
+	}
+	double median_ratio = bench_median(ratios, num_files);
+	double median_encode = bench_median(encode_mb_s, num_files);
+	double median_decode = bench_median(decode_mb_s, num_files);
+
+	printf(
+		"{\n  \"runs\": %d,\n  \"flags\": %d,\n  \"frame_len\": %d,\n  \"files\": [\n",
+		BENCH_CORPUS_RUNS, opts->flags, opts->frame_len
+	);
+	for (int i = 0; i < num_files; i++) {
+		printf("    {\"file\": ");
+		bench_json_str(files[i].path);
+		printf(", ");
+		bench_json_stats(&files[i]);
+		printf("}%s\n", i < num_files - 1 ? "," : "");
+	}
+	printf("  ],\n  \"total\": {");
+	bench_json_stats(&total);
+	printf("},\n  \"outliers\": [");
+
+	int num_outliers = 0;
+	for (int i = 0; i < num_files; i++) {
+		bench_file_t *f = &files[i];
+		const char *reason = NULL;
+		if ((double)f->raw_bytes / f->compressed_bytes < median_ratio * BENCH_OUTLIER_FACTOR) {
+			reason = "ratio";
+		}
+		else if (f->raw_bytes / f->encode_ns < median_encode * BENCH_OUTLIER_FACTOR) {
+			reason = "encode";
+		}
+		else if (f->raw_bytes / f->decode_ns < median_decode * BENCH_OUTLIER_FACTOR) {
+			reason = "decode";
+		}
+		if (reason) {
+			printf("%s\n    {\"file\": ", num_outliers++ ? "," : "");
+			bench_json_str(f->path);
+			printf(", \"reason\": \"%s\"}", reason);
+		}
+	}
+	printf("%s]", num_outliers ? "\n  " : "");
+
+	#ifdef BRAINWIRE_LATENCY
+		const char *names[] = {"encode", "decode"};
+		printf(",\n  \"latency_cycles\": {");
+		for (int i = 0; i < 2; i++) {
+			brainwire_latency_t *lat = &brainwire_latency[i];
+			printf(
+				"%s\n    \"%s\": {\"p50\": %llu, \"p99\": %llu, \"p99_9\": %llu, \"max\": %llu}",
+				i ? "," : "", names[i],
+				(unsigned long long)brainwire_latency_percentile(lat, 50),
+				(unsigned long long)brainwire_latency_percentile(lat, 99),
+				(unsigned long long)brainwire_latency_percentile(lat, 99.9),
+				(unsigned long long)lat->max
+			);
+		}
+		printf("\n  }");
+	#endif
+	printf("\n}\n");
+
+	for (int i = 0; i < num_files; i++) {
+		brainwire_free(files[i].sample_data);
+	}
+	free(files);
+	free(ratios);
+	free(encode_mb_s);
+	free(decode_mb_s);
+}
+
+static void bench_kernels(void) {
+	int *residuals = malloc(BENCH_SAMPLES * sizeof(int));
+	uint8_t *ks = malloc(BENCH_SAMPLES);
+	short *samples = malloc(BENCH_SAMPLES * sizeof(short));
+	int *quantized = malloc(BENCH_SAMPLES * sizeof(int));
+
+	// Generous: 64 bits per sample, far beyond any k for these distributions
+	int bytes_size = BENCH_SAMPLES * 8;
+	uint8_t *bytes = malloc(bytes_size);
+
+	printf(
+		"%-15s %5s %10s %10s %10s %10s %8s\n",
+		"kernel", "k", "ns/sample", "min", "MB/s", "cyc/sample", "rsd"
+	);
+
+	for (int k = 0; k <= BENCH_MAX_K; k++) {
+		for (int i = 0; i < BENCH_SAMPLES; i++) {
+			residuals[i] = bench_laplace(0.7 * (1 << k));
+		}
+		bench_rice(residuals, NULL, k, bytes, bytes_size);
+	}
+
+	// A synthetic recording: low passed noise with occasional spikes, coded
+	// with the same adaptive k as brainwire_write
+	double lp = 0;
+	for (int i = 0; i < BENCH_SAMPLES; i++) {
+		lp = lp * 0.95 + bench_laplace(2.0) * 0.3;
+		int q = (int)floor(lp + bench_laplace(1.5));
+		if (bench_rand() % 2000 == 0) {
+			q -= 60 + bench_rand() % 60;
+		}
+		q = q < -512 ? -512 : (q > 511 ? 511 : q);
+		samples[i] = brainwire_dequant(q);
+	}
+
+	float rice_k = 3;
+	int prev_quantized = 0;
+	for (int i = 0; i < BENCH_SAMPLES; i++) {
+		int q = brainwire_quant(samples[i]);
+		residuals[i] = q - prev_quantized;
+		prev_quantized = q;
+		ks[i] = rice_k;
+
+		uint32_t uval = ((uint32_t)residuals[i] << 1) ^ (residuals[i] >> 31);
+		int encoded_len = (uval >> ks[i]) + 1 + ks[i];
+		rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+	}
+	bench_rice(residuals, ks, 0, bytes, bytes_size);
+
+	bench_result_t result;
+	int sum = 0;
+
+	BENCH_RUN(&result, ,
+		for (int i = 0; i < BENCH_SAMPLES; i++) {
+			quantized[i] = brainwire_quant(samples[i]);
+		}
+	);
+	bench_report("quant", "-", &result);
+
+	BENCH_RUN(&result, ,
+		for (int i = 0; i < BENCH_SAMPLES; i++) {
+			samples[i] = brainwire_dequant(quantized[i]);
+		}
+	);
+	bench_report("dequant", "-", &result);
+
+	for (int i = 0; i < BENCH_SAMPLES; i++) {
+		sum += samples[i];
+	}
+	bench_sink = sum;
+
+	free(residuals);
+	free(ks);
+	free(samples);
+	free(quantized);
+	free(bytes);
+}
+
+int main(int argc, char **argv) {
+	brainwire_opts_t opts = {0};
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-n") == 0 && argc > 2) {
+			opts.flags |= BRAINWIRE_FLAG_HUM;
+			opts.mains_hz = atoi(argv[2]);
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "-w") == 0) {
+			opts.flags |= BRAINWIRE_FLAG_WAVELET;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "-s") == 0) {
+			opts.flags |= BRAINWIRE_FLAG_SPIKES;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "--turbo") == 0) {
+			opts.flags |= BRAINWIRE_FLAG_TURBO;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "--frames") == 0 && argc > 2) {
+			opts.flags |= BRAINWIRE_FLAG_FRAMES;
+			opts.frame_len = atoi(argv[2]);
+			ASSERT(opts.frame_len > 0 && opts.frame_len % BRAINWIRE_BLOCK == 0, "Frame length must be a multiple of %d", BRAINWIRE_BLOCK);
+			argv += 2;
+			argc -= 2;
+		}
+		else {
+			ABORT("Unknown option %s", argv[1]);
+		}
+	}
+
+	if (argc > 1) {
+		bench_corpus(argv + 1, argc - 1, &opts);
+	}
+	else {
+		bench_kernels();
+	}
+	return 0;
+}
@@ -0,0 +1,751 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+Differential check of the brainwire kernels against the frozen reference
+implementation in bwref.c
+
+Compile with:
+	gcc bwcheck.c -std=c99 -lm -O3 -o bwcheck
+
+Usage:
+	./bwcheck [in1.wav in2.wav ...]
+
+Checks that the kernels in brainwire.h are bit-identical with the reference:
+  - brainwire_quant() and brainwire_dequant() for every 16 bit input, and
+    brainwire_dequant_10bit() for every value of brainwire_quant()
+  - brainwire_f32() and brainwire_f16() for every 16 bit input, against 
+    v/32768 and the nearest half float (ties to even)
+  - rice_write() and rice_write_word() (the bytes, bit positions and 
+    returned lengths) and rice_read() and rice_read_word() (the values and
+    bit positions) for CHECK_VALUES randomized
+    residuals for each k from 0 to 16, plus the edge values of each k, and
+    for a stream where k changes with every residual
+  - the v1 stream written by brainwire_encode() and the samples returned by
+    brainwire_decode() against the original sample loops, for a synthetic
+    random walk and for each given WAV file
+  - the samples decoded from the streams of each coding mode, progressive
+    included, encoded with verification, against the input, for the same
+    files, for strong hum and for short and long inputs alternating between
+    full scale codes
+  - decoding ranges of the v1 stream and of a framed stream with hum 
+    predictor and spike templates from the checkpoint index against the
+    samples of brainwire_decode(), for the same files and for strong hum
+  - that a framed stream encoded from the 10 bit codes (as by 
+    `bwenc transcode`) is identical to the one encoded from the samples, 
+    that it decodes to the same codes, and that codes beyond 10 bits are
+    rejected in every mode
+  - the streams and samples of each kernel set supported by the CPU (see
+    "Sample loops" in brainwire.h) against the generic one, with and without 
+    the hum predictor, spike templates and frames, for the same files and
+    for strong hum
+  - the codes, float and half float samples decoded by each kernel set 
+    against the 16 bit samples, for the same files
+  - the .bw10 packing of each kernel set against the bit layout, and 
+    unpacking ranges starting and ending anywhere, for the same files
+  - the codes decoded from unframed and framed turbo streams against the
+    input, and that truncated turbo streams fail, for the same files
+  - the previews decoded from prefixes of a progressive stream, cut after
+    the band each preview level needs, against those of the whole stream
+  - that brainwire_encode() returns the smaller of the streams with and 
+    without the hum predictor, and that this is the one without it for the
+    random walk and the one with it for strong hum, for the same files
+
+Prints each check and exits with 1 if any of them failed. Run this (or
+`make diffcheck`) before merging any change to the kernels.
+
+*/
+
+#define BWENC_NO_MAIN
+#include "bwenc.c"
+#include "bwref.c"
+
+#define CHECK_VALUES (1 << 18)
+#define CHECK_MAX_K 16
+#define CHECK_MAX_MSBS 64 // keeps the unary part of random residuals short
+#define CHECK_WALK_SAMPLES (1 << 20)
+#define CHECK_HUM_AMP 200 // in codes
+
+#ifndef M_PI
+	#define M_PI 3.14159265358979323846
+#endif
+
+static int check_failed = 0;
+
+static void check_report(const char *name, const char *what, const char *error) {
+	printf("%-8s %-32s %s\n", name, what, error ? error : "ok");
+	if (error) {
+		check_failed = 1;
+	}
+}
+
+// Deterministic xorshift, so that failures are reproducible
+static uint32_t check_rand_state = 0x9e3779b9;
+static uint32_t check_rand(void) {
+	uint32_t x = check_rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return check_rand_state = x;
+}
+
+// A residual whose rice code with k has at most CHECK_MAX_MSBS unary bits.
+// Mostly small, laplacian like values, some uniform over the whole range.
+static int check_residual(int k) {
+	int range = (CHECK_MAX_MSBS << k) / 2;
+	int mag = (check_rand() & 3)
+		? (int)(-log((check_rand() + 1.0) / 4294967297.0) * (1 << k))
+		: (int)(check_rand() % range);
+	mag = mag < range ? mag : range - 1;
+	return (check_rand() & 1) ? mag : -mag - 1;
+}
+
+static void check_quant(void) {
+	char error[64] = {0};
+	for (int v = -32768; v <= 32767 && !error[0]; v++) {
+		if (brainwire_quant(v) != ref_quant(v)) {
+			snprintf(error, sizeof(error), "FAILED for %d", v);
+		}
+	}
+	check_report("quant", "all 16 bit samples", error[0] ? error : NULL);
+
+	error[0] = 0;
+	for (int v = -32768; v <= 32767 && !error[0]; v++) {
+		if (brainwire_dequant(v) != ref_dequant(v)) {
+			snprintf(error, sizeof(error), "FAILED for %d", v);
+		}
+	}
+	check_report("dequant", "all 16 bit values", error[0] ? error : NULL);
+
+	error[0] = 0;
+	for (int v = -512; v < 512 && !error[0]; v++) {
+		if (brainwire_dequant_10bit(v) != ref_dequant(v)) {
+			snprintf(error, sizeof(error), "FAILED for %d", v);
+		}
+	}
+	check_report("dequant", "10 bit integer only", error[0] ? error : NULL);
+
+	// The half floats from 0 up are ascending; the nearest is found by 
+	// bisection and the tie goes to the even one
+	static double halfs[0x7c00];
+	for (int h = 0; h < 0x7c00; h++) {
+		int exp = h >> 10;
+		int mant = h & 0x3ff;
+		halfs[h] = exp ? ldexp(1024 + mant, exp - 25) : ldexp(mant, -24);
+	}
+	error[0] = 0;
+	for (int v = -32768; v <= 32767 && !error[0]; v++) {
+		double x = fabs(v / 32768.0);
+		int lo = 0, hi = 0x7bff;
+		while (hi - lo > 1) {
+			int mid = (lo + hi) / 2;
+			*(halfs[mid] <= x ? &lo : &hi) = mid;
+		}
+		double dlo = x - halfs[lo], dhi = halfs[hi] - x;
+		int h = dlo < dhi || (dlo == dhi && !(lo & 1)) ? lo : hi;
+		h |= v < 0 ? 0x8000 : 0;
+		if (brainwire_f32(v) != (float)(v / 32768.0) || brainwire_f16(v) != h) {
+			snprintf(error, sizeof(error), "FAILED for %d", v);
+		}
+	}
+	check_report("float", "all 16 bit samples", error[0] ? error : NULL);
+}
+
+// Writes and reads back the residuals with ks[i] (or k, if ks is NULL) with
+// the reference, the current and the word-wise rice coder
+static void check_rice(const char *what, int *residuals, uint8_t *ks, int k, int count) {
+	int size = count * (CHECK_MAX_MSBS + 1 + CHECK_MAX_K) / 8 + 8;
+	uint8_t *ref_bytes = calloc(size + BRAINWIRE_PADDING, 1);
+	uint8_t *bytes = calloc(size + BRAINWIRE_PADDING, 1);
+	uint8_t *word_bytes = calloc(size + BRAINWIRE_PADDING, 1);
+	char error[64] = {0};
+
+	int ref_pos = 0;
+	int pos = 0;
+	int word_pos = 0;
+	for (int i = 0; i < count && !error[0]; i++) {
+		int ki = ks ? ks[i] : k;
+		int ref_len = ref_rice_write(ref_bytes, &ref_pos, residuals[i], ki);
+		int len = rice_write(bytes, &pos, residuals[i], ki);
+		int word_len = rice_write_word(word_bytes, &word_pos, residuals[i], ki);
+		if (len != ref_len || pos != ref_pos || word_len != ref_len || word_pos != ref_pos) {
+			snprintf(error, sizeof(error), "FAILED writing %d, k %d", residuals[i], ki);
+		}
+	}
+	if (!error[0] && (memcmp(ref_bytes, bytes, size) != 0 || memcmp(ref_bytes, word_bytes, size) != 0)) {
+		snprintf(error, sizeof(error), "FAILED, written bytes differ");
+	}
+
+	// The padding the decoder requires after a stream
+	int stream_len = (ref_pos + 7) / 8;
+	memset(ref_bytes + stream_len, 0xff, BRAINWIRE_PADDING);
+
+	ref_pos = 0;
+	pos = 0;
+	word_pos = 0;
+	for (int i = 0; i < count && !error[0]; i++) {
+		int ki = ks ? ks[i] : k;
+		int ref_v = ref_rice_read(ref_bytes, &ref_pos, ki);
+		int v = rice_read(ref_bytes, &pos, ki);
+		int word_v = rice_read_word(ref_bytes, &word_pos, ki);
+		if (v != ref_v || pos != ref_pos || v != residuals[i] || word_v != ref_v || word_pos != ref_pos) {
+			snprintf(error, sizeof(error), "FAILED reading %d, k %d", residuals[i], ki);
+		}
+	}
+
+	check_report("rice", what, error[0] ? error : NULL);
+	free(ref_bytes);
+	free(bytes);
+	free(word_bytes);
+}
+
+static void check_rice_all(void) {
+	int *residuals = malloc(CHECK_VALUES * sizeof(int));
+	uint8_t *ks = malloc(CHECK_VALUES);
+	char what[32];
+
+	for (int k = 0; k <= CHECK_MAX_K; k++) {
+		// The edge values of k first: the largest that fit in 0, 1 and
+		// CHECK_MAX_MSBS - 1 unary bits, and their negatives
+		int n = 0;
+		int edges[] = {0, 1 << k, (CHECK_MAX_MSBS << k) / 2};
+		for (int e = 0; e < 3; e++) {
+			residuals[n++] = edges[e] > 0 ? edges[e] - 1 : 0;
+			residuals[n++] = -edges[e] - (edges[e] > 0 ? 0 : 1);
+		}
+		for (; n < CHECK_VALUES; n++) {
+			residuals[n] = check_residual(k);
+		}
+		snprintf(what, sizeof(what), "k %d", k);
+		check_rice(what, residuals, NULL, k, CHECK_VALUES);
+	}
+
+	for (int i = 0; i < CHECK_VALUES; i++) {
+		ks[i] = check_rand() % (CHECK_MAX_K + 1);
+		residuals[i] = check_residual(ks[i]);
+	}
+	check_rice("k changing per residual", residuals, ks, 0, CHECK_VALUES);
+
+	free(residuals);
+	free(ks);
+}
+
+// Encodes and decodes the samples with the reference and the current codec
+static void check_codec(const char *what, short *sample_data, samples_t *desc) {
+	char error[64] = {0};
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+	brainwire_opts_t opts = {0};
+
+	uint8_t *ref_bytes = calloc(samples * 2 + 64 + BRAINWIRE_PADDING, 1);
+	int ref_len = ref_encode(sample_data, samples, desc->samplerate, ref_bytes);
+	int len;
+	uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+	if (!bytes) {
+		check_report("codec", what, "FAILED, can't encode");
+		free(ref_bytes);
+		return;
+	}
+	if (len != ref_len || memcmp(bytes, ref_bytes, len) != 0) {
+		snprintf(error, sizeof(error), "FAILED, encoded streams differ");
+	}
+
+	short *ref_decoded = malloc(samples * sizeof(short));
+	ref_decode(bytes, ref_decoded);
+	samples_t decoded_desc;
+	short *decoded = brainwire_decode(bytes, len, &decoded_desc, &opts);
+	if (!error[0] && (
+		!decoded || decoded_desc.samples != samples ||
+		memcmp(decoded, ref_decoded, samples * sizeof(short)) != 0
+	)) {
+		snprintf(error, sizeof(error), "FAILED, decoded samples differ");
+	}
+
+	check_report("codec", what, error[0] ? error : NULL);
+	brainwire_free(bytes);
+	brainwire_free(decoded);
+	free(ref_bytes);
+	free(ref_decoded);
+}
+
+// Decodes ranges of the stream of the samples from the checkpoints of its
+// index and compares them with the samples of brainwire_decode(). Framed 
+// streams have a checkpoint per frame.
+static void check_index(const char *what, short *sample_data, samples_t *desc, int flags) {
+	char error[64] = {0};
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+	brainwire_opts_t opts = {.flags = flags, .mains_hz = 50, .frame_len = 2 * BRAINWIRE_BLOCK};
+	int interval = (flags & BRAINWIRE_FLAG_FRAMES) ? opts.frame_len : BRAINWIRE_BLOCK;
+
+	int len = 0;
+	samples_t decoded_desc;
+	uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+	short *decoded = bytes ? brainwire_decode(bytes, len, &decoded_desc, &opts) : NULL;
+	brainwire_index_t *index = bytes ? brainwire_index(bytes, len, BRAINWIRE_BLOCK) : NULL;
+	short *range = malloc(samples * sizeof(short));
+	if (!bytes || !decoded) {
+		snprintf(error, sizeof(error), "FAILED, can't encode and decode");
+	}
+	else if (!index || index->count != (uint32_t)(samples + interval - 1) / interval) {
+		snprintf(error, sizeof(error), "FAILED, can't index");
+	}
+
+	// The whole stream, then ranges starting and ending anywhere
+	for (int i = 0; i < 64 && !error[0]; i++) {
+		int first = i ? (int)(check_rand() % (samples + 1)) : 0;
+		int count = i ? (int)(check_rand() % (samples - first + 1)) : samples;
+		if (
+			!brainwire_decode_range(bytes, len, index, first, count, range) ||
+			memcmp(range, decoded + first, count * sizeof(short)) != 0
+		) {
+			snprintf(error, sizeof(error), "FAILED for %d samples from %d", count, first);
+		}
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s%s", flags & BRAINWIRE_FLAG_TURBO ? "turbo " : "", what);
+	check_report(flags ? "frames" : "index", name, error[0] ? error : NULL);
+	brainwire_free(bytes);
+	brainwire_free(decoded);
+	brainwire_free(index);
+	free(range);
+}
+
+// Encodes the samples with the hum predictor and checks that the stream is
+// the smaller one of those coded with and without it. With expect_kept 0 or
+// 1, also whether that is the one with the predictor.
+static void check_hum(const char *what, short *sample_data, samples_t *desc, int expect_kept) {
+	char error[64] = {0};
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+	brainwire_opts_t opts = {.flags = BRAINWIRE_FLAG_HUM, .mains_hz = 50};
+	brainwire_opts_t plain_opts = {.mains_hz = 50};
+
+	int len = 0, hum_len = 0, plain_len = 0;
+	uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+	uint8_t *hum = brainwire_encode_stream(sample_data, &mono, &opts, INT32_MAX, &hum_len);
+	uint8_t *plain = brainwire_encode(sample_data, &mono, &plain_opts, &plain_len);
+	int kept = hum_len < plain_len;
+	if (!bytes || !hum || !plain) {
+		snprintf(error, sizeof(error), "FAILED, can't encode");
+	}
+	else if (len != (kept ? hum_len : plain_len) || memcmp(bytes, kept ? hum : plain, len) != 0) {
+		snprintf(error, sizeof(error), "FAILED, not the smaller stream");
+	}
+	else if (expect_kept >= 0 && kept != expect_kept) {
+		snprintf(error, sizeof(error), "FAILED, the predictor %s", kept ? "saves" : "doesn't save");
+	}
+	check_report("hum", what, error[0] ? error : NULL);
+	brainwire_free(bytes);
+	brainwire_free(hum);
+	brainwire_free(plain);
+}
+
+// Encodes the samples in each coding mode, with verification, and compares
+// the decoded samples with them
+static void check_lossless(const char *what, short *sample_data, samples_t *desc) {
+	static const int modes[] = {
+		0, BRAINWIRE_FLAG_HUM, BRAINWIRE_FLAG_SPIKES,
+		BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES,
+		BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO, BRAINWIRE_FLAG_WAVELET
+	};
+	char error[64] = {0};
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+
+	for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])) && !error[0]; m++) {
+		brainwire_opts_t opts = {.flags = modes[m], .mains_hz = 50, .verify = 1};
+		int len;
+		samples_t decoded_desc;
+		uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+		short *decoded = bytes ? brainwire_decode(bytes, len, &decoded_desc, &opts) : NULL;
+		if (
+			!decoded || decoded_desc.samples != (uint32_t)samples ||
+			memcmp(decoded, sample_data, samples * sizeof(short)) != 0
+		) {
+			snprintf(error, sizeof(error), "FAILED, flags %d: %s", modes[m], bytes ? "samples differ" : brainwire_error);
+		}
+		brainwire_free(bytes);
+		brainwire_free(decoded);
+	}
+	check_report("lossless", what, error[0] ? error : NULL);
+}
+
+// Encodes the samples and their codes as framed streams and compares the 
+// streams, and the codes decoded from them
+static void check_codes(const char *what, short *sample_data, samples_t *desc) {
+	char error[64] = {0};
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+	brainwire_opts_t opts = {.flags = BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_SPIKES, .verify = 1};
+	brainwire_opts_t codes_opts = opts;
+	codes_opts.format = BRAINWIRE_FORMAT_CODES;
+
+	short *codes = malloc(samples * sizeof(short));
+	for (int i = 0; i < samples; i++) {
+		codes[i] = brainwire_quant(sample_data[i]);
+	}
+
+	int len, codes_len;
+	samples_t decoded_desc;
+	uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+	uint8_t *codes_bytes = brainwire_encode(codes, &mono, &codes_opts, &codes_len);
+	short *decoded = codes_bytes ? brainwire_decode(codes_bytes, codes_len, &decoded_desc, &codes_opts) : NULL;
+	if (!bytes || !codes_bytes || len != codes_len || memcmp(bytes, codes_bytes, len) != 0) {
+		snprintf(error, sizeof(error), "FAILED, encoded streams differ");
+	}
+	else if (!decoded || memcmp(decoded, codes, samples * sizeof(short)) != 0) {
+		snprintf(error, sizeof(error), "FAILED, decoded codes differ");
+	}
+
+	// Codes beyond 10 bits, as decoded from legacy streams, must be rejected
+	// in every mode
+	static const int out_of_range_flags[] = {
+		0, BRAINWIRE_FLAG_HUM, BRAINWIRE_FLAG_SPIKES, BRAINWIRE_FLAG_WAVELET,
+		BRAINWIRE_FLAG_FRAMES, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO
+	};
+	for (int i = 0; i < 6 && samples && !error[0]; i++) {
+		brainwire_opts_t out_of_range_opts = {.flags = out_of_range_flags[i], .format = BRAINWIRE_FORMAT_CODES};
+		short saved = codes[samples / 2];
+		codes[samples / 2] = (i & 1) ? -513 : 30000;
+		int out_of_range_len = 0;
+		uint8_t *out_of_range = brainwire_encode(codes, &mono, &out_of_range_opts, &out_of_range_len);
+		codes[samples / 2] = saved;
+		if (out_of_range) {
+			snprintf(error, sizeof(error), "FAILED, encoded codes beyond 10 bits with flags %d", out_of_range_flags[i]);
+			brainwire_free(out_of_range);
+		}
+	}
+
+	check_report("codes", what, error[0] ? error : NULL);
+	brainwire_free(bytes);
+	brainwire_free(codes_bytes);
+	brainwire_free(decoded);
+	free(codes);
+}
+
+// Encodes and decodes the samples with each supported kernel set in each 
+// coding mode and compares the results with those of the generic set
+static void check_kernel_sets(const char *file, short *sample_data, samples_t *desc) {
+	int modes[] = {
+		0, BRAINWIRE_FLAG_HUM, BRAINWIRE_FLAG_SPIKES, BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES, 
+		BRAINWIRE_FLAG_FRAMES, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES,
+		BRAINWIRE_FLAG_TURBO, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO
+	};
+	int num_modes = sizeof(modes) / sizeof(modes[0]);
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+
+	for (int set = 1; set < BRAINWIRE_KERNEL_SETS; set++) {
+		if (!brainwire_kernels_supported(set)) {
+			continue;
+		}
+		char what[64];
+		char error[64] = {0};
+		snprintf(what, sizeof(what), "%s %s", brainwire_kernel_sets[set].name, file);
+
+		for (int m = 0; m < num_modes && !error[0]; m++) {
+			brainwire_opts_t opts = {.flags = modes[m], .mains_hz = 50};
+			int ref_len, len;
+			samples_t ref_desc, decoded_desc;
+
+			brainwire_kernels_select("generic");
+			uint8_t *ref_bytes = brainwire_encode(sample_data, &mono, &opts, &ref_len);
+			short *ref_decoded = ref_bytes ? brainwire_decode(ref_bytes, ref_len, &ref_desc, &opts) : NULL;
+
+			brainwire_kernels_select(brainwire_kernel_sets[set].name);
+			uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+			short *decoded = ref_bytes ? brainwire_decode(ref_bytes, ref_len, &decoded_desc, &opts) : NULL;
+
+			if (!ref_bytes || !ref_decoded || !bytes) {
+				snprintf(error, sizeof(error), "FAILED, can't encode and decode, flags %d", modes[m]);
+			}
+			else if (len != ref_len || memcmp(bytes, ref_bytes, len) != 0) {
+				snprintf(error, sizeof(error), "FAILED, encoded streams differ, flags %d", modes[m]);
+			}
+			else if (!decoded || memcmp(decoded, ref_decoded, ref_desc.samples * sizeof(short)) != 0) {
+				snprintf(error, sizeof(error), "FAILED, decoded samples differ, flags %d", modes[m]);
+			}
+			brainwire_free(ref_bytes);
+			brainwire_free(ref_decoded);
+			brainwire_free(bytes);
+			brainwire_free(decoded);
+		}
+		check_report("kernels", what, error[0] ? error : NULL);
+	}
+	brainwire_kernels_select(NULL);
+}
+
+// Decodes the stream of the samples to each format with each supported 
+// kernel set and compares the samples with the 16 bit ones
+static void check_formats(const char *what, short *sample_data, samples_t *desc, int flags) {
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+	brainwire_opts_t opts = {.flags = flags};
+	int len;
+	samples_t decoded_desc;
+	uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+	short *s16 = bytes ? brainwire_decode(bytes, len, &decoded_desc, &opts) : NULL;
+
+	for (int set = 0; set < BRAINWIRE_KERNEL_SETS; set++) {
+		if (!brainwire_kernels_supported(set)) {
+			continue;
+		}
+		brainwire_kernels_select(brainwire_kernel_sets[set].name);
+		char name[64];
+		char error[64] = {0};
+		snprintf(
+			name, sizeof(name), "%s %s%s", brainwire_kernel_sets[set].name, 
+			flags & BRAINWIRE_FLAG_TURBO ? "turbo " : "", what
+		);
+
+		if (!s16) {
+			snprintf(error, sizeof(error), "FAILED, can't encode and decode");
+		}
+		for (int format = BRAINWIRE_FORMAT_CODES; format <= BRAINWIRE_FORMAT_F16 && !error[0]; format++) {
+			opts.format = format;
+			void *decoded = brainwire_decode(bytes, len, &decoded_desc, &opts);
+			if (!decoded) {
+				snprintf(error, sizeof(error), "FAILED, can't decode format %d", format);
+			}
+			for (int i = 0; i < samples && !error[0]; i++) {
+				int ok = 
+					format == BRAINWIRE_FORMAT_CODES ? ((short *)decoded)[i] == brainwire_quant(s16[i]) :
+					format == BRAINWIRE_FORMAT_F32 ? ((float *)decoded)[i] == brainwire_f32(s16[i]) :
+					((uint16_t *)decoded)[i] == brainwire_f16(s16[i]);
+				if (!ok) {
+					snprintf(error, sizeof(error), "FAILED, format %d differs at %d", format, i);
+				}
+			}
+			brainwire_free(decoded);
+		}
+		check_report("formats", name, error[0] ? error : NULL);
+	}
+	brainwire_kernels_select(NULL);
+	brainwire_free(bytes);
+	brainwire_free(s16);
+}
+
+// Packs the samples with each supported kernel set, compares each code with
+// its bits and unpacks ranges of them
+static void check_bw10(const char *what, short *sample_data, samples_t *desc) {
+	int samples = desc->samples * desc->channels;
+	int size = (int)(((int64_t)samples * 10 + 7) / 8);
+	uint8_t *bytes = malloc(size + 16);
+	short *range = malloc(samples * sizeof(short) + 16);
+
+	for (int set = 0; set < BRAINWIRE_KERNEL_SETS; set++) {
+		if (!brainwire_kernels_supported(set)) {
+			continue;
+		}
+		const brainwire_kernels_t *kernels = &brainwire_kernel_sets[set];
+		char name[64];
+		char error[64] = {0};
+		snprintf(name, sizeof(name), "%s %s", kernels->name, what);
+
+		memset(bytes, 0, size + 16);
+		kernels->pack10(bytes, sample_data, samples, BRAINWIRE_FORMAT_S16);
+		for (int i = 0; i < samples && !error[0]; i++) {
+			int code = 0;
+			for (int b = 0; b < 10; b++) {
+				int64_t bit = (int64_t)i * 10 + b;
+				code |= ((bytes[bit >> 3] >> (bit & 7)) & 1) << b;
+			}
+			if (code - 512 != brainwire_quant(sample_data[i])) {
+				snprintf(error, sizeof(error), "FAILED, packed code %d differs", i);
+			}
+		}
+		for (int i = size; i < size + 16 && !error[0]; i++) {
+			if (bytes[i]) {
+				snprintf(error, sizeof(error), "FAILED, wrote past the end");
+			}
+		}
+
+		for (int i = 0; i < 64 && !error[0]; i++) {
+			int first = i ? (int)(check_rand() % (samples + 1)) : 0;
+			int count = i ? (int)(check_rand() % (samples - first + 1)) : samples;
+			kernels->unpack10(bytes, first, count, range, BRAINWIRE_FORMAT_CODES);
+			for (int j = 0; j < count && !error[0]; j++) {
+				if (range[j] != brainwire_quant(sample_data[first + j])) {
+					snprintf(error, sizeof(error), "FAILED for %d samples from %d", count, first);
+				}
+			}
+		}
+		check_report("bw10", name, error[0] ? error : NULL);
+	}
+	free(bytes);
+	free(range);
+}
+
+// Cuts the progressive stream of the samples after the last band each 
+// preview level needs and compares the preview decoded from that prefix 
+// with the one from the whole stream. One byte less has to fail.
+static void check_preview(const char *what, short *sample_data, samples_t *desc) {
+	char error[64] = {0};
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+	brainwire_opts_t opts = {.flags = BRAINWIRE_FLAG_WAVELET};
+	int len;
+	uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+	brainwire_stream_t stream = {.bytes = bytes, .end = (int64_t)len * 8};
+	if (!bytes || brainwire_read_header(&stream)) {
+		snprintf(error, sizeof(error), "FAILED, can't encode");
+	}
+
+	uint8_t *prefix = malloc(len + BRAINWIRE_PADDING);
+	int bit_pos = stream.bit_pos;
+	for (int level = BRAINWIRE_WAVELET_LEVELS; level >= 0 && !error[0]; level--) {
+		int band_bytes = rice_read(bytes, &bit_pos, 16);
+		bit_pos = ((bit_pos + 7) & ~7) + band_bytes * 8;
+		int prefix_len = bit_pos / 8;
+
+		samples_t ref_desc, decoded_desc;
+		opts.preview_level = level;
+		short *ref = brainwire_decode(bytes, len, &ref_desc, &opts);
+		memcpy(prefix, bytes, prefix_len);
+		memset(prefix + prefix_len, 0xff, BRAINWIRE_PADDING);
+		short *decoded = brainwire_decode(prefix, prefix_len, &decoded_desc, &opts);
+		if (
+			!ref || !decoded || decoded_desc.samples != ref_desc.samples ||
+			memcmp(decoded, ref, ref_desc.samples * sizeof(short)) != 0
+		) {
+			snprintf(error, sizeof(error), "FAILED, level %d from %d bytes", level, prefix_len);
+		}
+		brainwire_free(ref);
+		brainwire_free(decoded);
+
+		memset(prefix + prefix_len - 1, 0xff, BRAINWIRE_PADDING);
+		decoded = brainwire_decode(prefix, prefix_len - 1, &decoded_desc, &opts);
+		if (decoded) {
+			snprintf(error, sizeof(error), "FAILED, level %d from %d bytes", level, prefix_len - 1);
+		}
+		brainwire_free(decoded);
+	}
+
+	check_report("preview", what, error[0] ? error : NULL);
+	brainwire_free(bytes);
+	free(prefix);
+}
+
+// Encodes the samples as turbo blocks, unframed and framed, and compares 
+// the decoded codes with their own. Truncated streams have to fail.
+static void check_turbo(const char *what, short *sample_data, samples_t *desc) {
+	int samples = desc->samples * desc->channels;
+	samples_t mono = {.channels = 1, .samplerate = desc->samplerate, .samples = samples};
+	int modes[] = {BRAINWIRE_FLAG_TURBO, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO};
+	char error[64] = {0};
+
+	for (int m = 0; m < 2 && !error[0]; m++) {
+		brainwire_opts_t opts = {.flags = modes[m], .frame_len = 2 * BRAINWIRE_BLOCK, .verify = 1};
+		brainwire_opts_t codes_opts = {.format = BRAINWIRE_FORMAT_CODES};
+		int len;
+		samples_t decoded_desc;
+		uint8_t *bytes = brainwire_encode(sample_data, &mono, &opts, &len);
+		short *decoded = bytes ? brainwire_decode(bytes, len, &decoded_desc, &codes_opts) : NULL;
+		if (!decoded || decoded_desc.samples != (uint32_t)samples) {
+			snprintf(error, sizeof(error), "FAILED, can't decode, flags %d", modes[m]);
+		}
+		for (int i = 0; i < samples && !error[0]; i++) {
+			if (decoded[i] != brainwire_quant(sample_data[i])) {
+				snprintf(error, sizeof(error), "FAILED, code %d differs, flags %d", i, modes[m]);
+			}
+		}
+		brainwire_free(decoded);
+
+		for (int i = 0; i < 16 && bytes && samples && !error[0]; i++) {
+			int truncated = i ? (int)(check_rand() % len) : len - 1;
+			decoded = brainwire_decode(bytes, truncated, &decoded_desc, &codes_opts);
+			if (decoded) {
+				snprintf(error, sizeof(error), "FAILED, decoded %d of %d bytes", truncated, len);
+			}
+			brainwire_free(decoded);
+		}
+		brainwire_free(bytes);
+	}
+	check_report("turbo", what, error[0] ? error : NULL);
+}
+
+int main(int argc, char **argv) {
+	check_quant();
+	check_rice_all();
+
+	// A random walk on the 10 bit lattice, with occasional large steps
+	short *walk = malloc(CHECK_WALK_SAMPLES * sizeof(short));
+	int q = 0;
+	for (int i = 0; i < CHECK_WALK_SAMPLES; i++) {
+		q += (check_rand() % 64 == 0) ? (int)(check_rand() % 1024) - 512 : (int)(check_rand() % 9) - 4;
+		q = q < -512 ? -512 : (q > 511 ? 511 : q);
+		walk[i] = ref_dequant(q);
+	}
+	samples_t desc = {.channels = 1, .samplerate = 19531, .samples = CHECK_WALK_SAMPLES};
+	check_codec("random walk", walk, &desc);
+	check_lossless("random walk", walk, &desc);
+	check_index("random walk", walk, &desc, 0);
+	check_index("random walk", walk, &desc, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES);
+	check_index("random walk", walk, &desc, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO);
+	check_codes("random walk", walk, &desc);
+	check_kernel_sets("random walk", walk, &desc);
+	check_formats("random walk", walk, &desc, BRAINWIRE_FLAG_FRAMES);
+	check_formats("random walk", walk, &desc, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO);
+	desc.samples = CHECK_WALK_SAMPLES - 3; // not a whole group of 8
+	check_bw10("random walk", walk, &desc);
+	check_turbo("random walk", walk, &desc);
+	check_preview("random walk", walk, &desc);
+	check_hum("random walk", walk, &desc, 0);
+
+	// Strong 50 Hz hum over low noise, which the predictor is kept for, for
+	// the checks that use it. On the random walk, the first difference 
+	// already removes most of it.
+	desc.samples = CHECK_WALK_SAMPLES;
+	for (int i = 0; i < CHECK_WALK_SAMPLES; i++) {
+		int noise = (int)(check_rand() % 5) - 2;
+		walk[i] = ref_dequant(noise + (int)lrint(CHECK_HUM_AMP * sin(2 * M_PI * 50 * i / desc.samplerate)));
+	}
+	check_hum("hum", walk, &desc, 1);
+	check_lossless("hum", walk, &desc);
+	check_index("hum", walk, &desc, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES);
+	check_kernel_sets("hum", walk, &desc);
+
+	// Flat and linear stretches pack to 0 bits per residual
+	for (int i = 0; i < CHECK_WALK_SAMPLES; i++) {
+		walk[i] = i % 5000 < 2000 ? ref_dequant(100) : ref_dequant((i % 1024) - 512);
+	}
+	check_turbo("flat and linear", walk, &desc);
+
+	// Full scale steps take the longest rice codes, far beyond 2 bytes per
+	// sample at the initial k
+	for (int i = 0; i < CHECK_WALK_SAMPLES; i++) {
+		walk[i] = ref_dequant(i % 2 ? -512 : 511);
+	}
+	int full_scale_lens[] = {1, 5, 17, 40, CHECK_WALK_SAMPLES};
+	for (int i = 0; i < 5; i++) {
+		desc.samples = full_scale_lens[i];
+		char name[32];
+		snprintf(name, sizeof(name), "full scale, %d samples", full_scale_lens[i]);
+		check_lossless(name, walk, &desc);
+	}
+	free(walk);
+
+	for (int i = 1; i < argc; i++) {
+		short *sample_data = wav_read(argv[i], &desc);
+		ASSERT(sample_data, "Can't load %s: %s", argv[i], brainwire_error);
+		check_codec(argv[i], sample_data, &desc);
+		check_lossless(argv[i], sample_data, &desc);
+		check_index(argv[i], sample_data, &desc, 0);
+		check_index(argv[i], sample_data, &desc, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_HUM | BRAINWIRE_FLAG_SPIKES);
+		check_index(argv[i], sample_data, &desc, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO);
+		check_codes(argv[i], sample_data, &desc);
+		check_kernel_sets(argv[i], sample_data, &desc);
+		check_formats(argv[i], sample_data, &desc, BRAINWIRE_FLAG_FRAMES);
+		check_formats(argv[i], sample_data, &desc, BRAINWIRE_FLAG_FRAMES | BRAINWIRE_FLAG_TURBO);
+		check_bw10(argv[i], sample_data, &desc);
+		check_turbo(argv[i], sample_data, &desc);
+		check_preview(argv[i], sample_data, &desc);
+		check_hum(argv[i], sample_data, &desc, -1);
+		brainwire_free(sample_data);
+	}
+
+	return check_failed;
+}
@@ -0,0 +1,74 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+Decoder only command line tool, built for size
+
+Compile with:
+	make bwdec
+
+or
+	gcc bwdec.c -std=c99 -Os -flto -ffunction-sections -fdata-sections \
+		-Wl,--gc-sections -s -o bwdec
+
+Usage:
+	./bwdec comp.bw decomp.wav
+
+Decodes like `bwenc comp.bw decomp.wav`, but without the encoder, the WAV
+reader and writer, the statistics, the USDT probes and the sample loops for
+other instruction sets, and without libm. The WAV header is assembled in
+memory. `make size` compares its size and decode speed with bwenc.
+
+*/
+
+#define BRAINWIRE_NO_ENCODER
+#define BRAINWIRE_NO_WAV
+#define BRAINWIRE_NO_STATS
+#define BRAINWIRE_NO_USDT
+#define BRAINWIRE_NO_DISPATCH
+#define BWENC_NO_MAIN
+#include "bwenc.c"
+
+static void bwdec_put_u32(uint8_t *p, uint32_t v) {
+	p[0] = 0xff & (v      );
+	p[1] = 0xff & (v >>  8);
+	p[2] = 0xff & (v >> 16);
+	p[3] = 0xff & (v >> 24);
+}
+
+static void bwdec_put_u16(uint8_t *p, uint32_t v) {
+	p[0] = 0xff & (v      );
+	p[1] = 0xff & (v >>  8);
+}
+
+int main(int argc, char **argv) {
+	ASSERT(argc == 3, "\nUsage: bwdec in.bw out.wav");
+
+	brainwire_opts_t opts = {0};
+	samples_t desc;
+	short *sample_data = brainwire_read(argv[1], &desc, &opts);
+	ASSERT(sample_data, "Can't decode %s: %s", argv[1], brainwire_error);
+
+	// Same header as wav_write_header()
+	uint32_t data_size = desc.samples * desc.channels * sizeof(short);
+	uint8_t header[44];
+	memcpy(header, "RIFF\0\0\0\0WAVEfmt \x10\x00\x00\x00\x01\x00", 22);
+	bwdec_put_u32(header + 4, data_size + 44 - 8);
+	bwdec_put_u16(header + 22, desc.channels);
+	bwdec_put_u32(header + 24, desc.samplerate);
+	bwdec_put_u32(header + 28, desc.channels * desc.samplerate * 2);
+	bwdec_put_u16(header + 32, desc.channels * 2);
+	bwdec_put_u16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	bwdec_put_u32(header + 40, data_size);
+
+	FILE *fh = fopen(argv[2], "wb");
+	ASSERT(fh, "Can't open %s for writing", argv[2]);
+	int wrote = fwrite(header, sizeof(header), 1, fh);
+	wrote &= data_size == 0 || fwrite(sample_data, data_size, 1, fh);
+	ASSERT(fclose(fh) == 0 && wrote, "Write error");
+
+	brainwire_free(sample_data);
+	return 0;
+}
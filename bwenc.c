@@ -6,20 +6,93 @@ SPDX-License-Identifier: MIT
 Command line tool to compress neuralink samples
 
 Compile with: 
-	gcc bwenc.c -std=c99 -lm -O3 -o bwenc
+	gcc bwenc.c -std=c99 -lm -pthread -O3 -o bwenc
+
+or use the Makefile, which also builds the codec as a library and has a 
+profile guided build (make pgo). The codec itself is the single header 
+library brainwire.h; see there for the compile options (USDT probes, 
+-DBRAINWIRE_NO_STATS, -DBRAINWIRE_LATENCY, whose percentiles bwenc prints)
+and BRAINWIRE_ISA.
 
 Usage:
-	./bwenc in.wav comp.bw
+	./bwenc [options] in.wav comp.bw
 	./bwenc comp.bw decomp.wav
+	./bwenc comp.bw decomp.{f32,f16}
+	./bwenc in.{wav,bw} staged.bw10
+	./bwenc staged.bw10 out.{wav,bw,f32,f16}
+	./bwenc comp.bw comp.bwi
+	./bwenc transcode [options] out_dir in1.bw in2.bw ...
+
+Options:
+	-n 50|60   subtract an adaptive estimate of 50/60 Hz mains hum before
+	           coding, if that makes the stream smaller; writes a v2 stream then
+	-w         progressive mode: code 5/3 wavelet subbands coarse-to-fine; 
+	           writes a v2 stream
+	-p level   when decoding a progressive stream, stop after the lowpass
+	           band of this level and write a preview at samplerate/2^level
+	-s         code spikes against an adaptive dictionary of waveform 
+	           templates; writes a v2 stream
+	-t out.csv when decoding a stream coded with -s, write the sample index
+	           and template of each detected spike event
+	--turbo    bit-pack the residuals in blocks of 128 instead of rice 
+	           coding them: larger files that decode several times faster;
+	           writes a v2 stream
+	--perf     print hardware performance counters (cycles, instructions,
+	           branch and cache misses) for each pipeline stage; Linux only
+	--mem-report
+	           print the bytes allocated and the peak heap use of reading
+	           and writing, per input byte, and the peak RSS
+	--stats out.json
+	           write statistics of the coded residuals: histogram, rice_k 
+	           distribution, unary/binary bit split and bits/sample over 
+	           sliding windows
+	--verify   decode the encoded stream in memory while encoding and fail
+	           if it doesn't reproduce the input exactly; nothing is written
+	           then
+	--frames samples
+	           code the stream in independent frames of this many samples 
+	           (a multiple of 4096), with a frame table to seek and decode 
+	           them in parallel; writes a v2 stream
+	--interval samples
+	           with out.bwi, the distance of the checkpoints (default 65536)
+	--index in.bwi
+	           decode a v1 or framed stream with its checkpoint index, 
+	           written with `bwenc comp.bw comp.bwi`
+	-j threads decode in parallel on this many threads, split at the 
+	           checkpoints of --index or of an index built in memory; for
+	           transcode, the number of files transcoded at once
+	--range first:count
+	           decode only count samples from first on, seeking with the 
+	           checkpoint index, or directly in a .bw10 file
+
+Decoding to .f32 or .f16 writes the samples as raw little endian float or 
+half float, normalized to -1..1, converted in the decoder's sample loop.
+
+.bw10 files hold the 10 bit codes bit packed, without entropy coding. 
+Between .bw and .bw10, the codes are passed on without dequantizing them.
+--range also reads a part of a .bw10 file.
+
+transcode rewrites existing streams as framed streams (--frames, 65536 
+samples by default) into out_dir, under the same names. The quantized 
+values go straight from the decoder to the encoder, without dequantizing 
+and quantizing them again. -n, -s, --turbo and --verify apply to the new
+streams.
 
 */
 
+#if defined(__linux__) && !defined(BWENC_NO_MAIN)
+	#define _GNU_SOURCE // for syscall(), used by --perf
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdint.h>
 
+#define BRAINWIRE_IMPLEMENTATION
+#include "brainwire.h"
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define ABORT(...) \
@@ -33,341 +106,638 @@ Usage:
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
-typedef struct {
-	uint32_t channels;
-	uint32_t samplerate;
-	uint32_t samples;
-} samples_t;
 
 
 /* -----------------------------------------------------------------------------
-	WAV reader / writer */
-
-#define WAV_CHUNK_ID(S) \
-	(((uint32_t)(S[3])) << 24 | ((uint32_t)(S[2])) << 16 | \
-	 ((uint32_t)(S[1])) <<  8 | ((uint32_t)(S[0])))
-
-void fwrite_u32_le(uint32_t v, FILE *fh) {
-	uint8_t buf[sizeof(uint32_t)];
-	buf[0] = 0xff & (v      );
-	buf[1] = 0xff & (v >>  8);
-	buf[2] = 0xff & (v >> 16);
-	buf[3] = 0xff & (v >> 24);
-	int wrote = fwrite(buf, sizeof(uint32_t), 1, fh);
-	ASSERT(wrote, "Write error");
-}
-
-void fwrite_u16_le(unsigned short v, FILE *fh) {
-	uint8_t buf[sizeof(unsigned short)];
-	buf[0] = 0xff & (v      );
-	buf[1] = 0xff & (v >>  8);
-	int wrote = fwrite(buf, sizeof(unsigned short), 1, fh);
-	ASSERT(wrote, "Write error");
-}
-
-uint32_t fread_u32_le(FILE *fh) {
-	uint8_t buf[sizeof(uint32_t)];
-	int read = fread(buf, sizeof(uint32_t), 1, fh);
-	ASSERT(read, "Read error or unexpected end of file");
-	return (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
-}
+	Main
+
+Define BWENC_NO_MAIN to include this file in other tools, e.g. bwbench.c */
+
+#ifndef BWENC_NO_MAIN
+
+/* --perf: one perf_event group per pipeline stage, enabled and disabled by 
+brainwire_perf_hook around each stage, so the counts accumulate in the 
+kernel and are read once at the end. The per-sample stages are timed per 
+block; the two ioctls per block add ~1us of user+kernel time, of which only
+the few user space instructions are counted. */
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+
+	#define PERF_COUNTERS 5
+
+	static const char *perf_stage_names[BRAINWIRE_PERF_STAGES] = {
+		"parse", "quantize", "entropy", "dequantize", "write"
+	};
+	static int perf_fds[BRAINWIRE_PERF_STAGES][PERF_COUNTERS];
+	static int perf_used[BRAINWIRE_PERF_STAGES];
+
+	static int perf_open(uint32_t type, uint64_t config, int group_fd) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = group_fd == -1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+	}
 
-unsigned short fread_u16_le(FILE *fh) {
-	uint8_t buf[sizeof(unsigned short)];
-	int read = fread(buf, sizeof(unsigned short), 1, fh);
-	ASSERT(read, "Read error or unexpected end of file");
-	return (buf[1] << 8) | buf[0];
-}
+	static void perf_hook(int stage, int begin) {
+		int request = begin ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+		ioctl(perf_fds[stage][0], request, PERF_IOC_FLAG_GROUP);
+		perf_used[stage] = 1;
+	}
 
-int wav_write(const char *path, short *sample_data, samples_t *desc) {
-	uint32_t data_size = desc->samples * desc->channels * sizeof(short);
-	uint32_t samplerate = desc->samplerate;
-	short bits_per_sample = 16;
-	short channels = desc->channels;
+	void perf_init(void) {
+		static const struct { uint32_t type; uint64_t config; } events[PERF_COUNTERS] = {
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+			{PERF_TYPE_HW_CACHE, 
+				PERF_COUNT_HW_CACHE_L1D | 
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) | 
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}
+		};
+
+		for (int s = 0; s < BRAINWIRE_PERF_STAGES; s++) {
+			perf_fds[s][0] = perf_open(events[0].type, events[0].config, -1);
+			ASSERT(perf_fds[s][0] >= 0, "perf_event_open failed; check /proc/sys/kernel/perf_event_paranoid");
+
+			// Not all events are available everywhere (e.g. in VMs)
+			for (int e = 1; e < PERF_COUNTERS; e++) {
+				perf_fds[s][e] = perf_open(events[e].type, events[e].config, perf_fds[s][0]);
+			}
+		}
+		brainwire_perf_hook = perf_hook;
+	}
 
-	// Lifted from https://www.jonolick.com/code.html - public domain
-	// Made endian agnostic using fwrite_u*()
-	FILE *fh = fopen(path, "wb");
-	ASSERT(fh, "Can't open %s for writing", path);
-	fwrite("RIFF", 1, 4, fh);
-	fwrite_u32_le(data_size + 44 - 8, fh);
-	fwrite("WAVEfmt \x10\x00\x00\x00\x01\x00", 1, 14, fh);
-	fwrite_u16_le(channels, fh);
-	fwrite_u32_le(samplerate, fh);
-	fwrite_u32_le(channels * samplerate * bits_per_sample/8, fh);
-	fwrite_u16_le(channels * bits_per_sample/8, fh);
-	fwrite_u16_le(bits_per_sample, fh);
-	fwrite("data", 1, 4, fh);
-	fwrite_u32_le(data_size, fh);
-	fwrite((void*)sample_data, data_size, 1, fh);
-	fclose(fh);
-	return data_size  + 44 - 8;
-}
+	void perf_report(int samples) {
+		printf(
+			"%-10s %12s %12s %6s %15s %15s %15s\n", "stage", "cycles", "instructions", 
+			"IPC", "br-miss/sample", "L1d-miss/sample", "LLC-miss/sample"
+		);
+		for (int s = 0; s < BRAINWIRE_PERF_STAGES; s++) {
+			if (!perf_used[s]) {
+				continue;
+			}
 
-short *wav_read(const char *path, samples_t *desc) {
-	FILE *fh = fopen(path, "rb");
-	ASSERT(fh, "Can't open %s for reading", path);
+			// The group read only contains the events that could be opened
+			uint64_t buf[1 + PERF_COUNTERS];
+			int got = read(perf_fds[s][0], buf, sizeof(buf));
+			ASSERT(got > 0, "Reading perf counters failed");
+			double values[PERF_COUNTERS];
+			for (int e = 0, n = 1; e < PERF_COUNTERS; e++) {
+				values[e] = perf_fds[s][e] >= 0 ? (double)buf[n++] : -1;
+			}
 
-	uint32_t container_type = fread_u32_le(fh);
-	ASSERT(container_type == WAV_CHUNK_ID("RIFF"), "Not a RIFF container");
-
-	uint32_t wav_size = fread_u32_le(fh);
-	uint32_t wavid = fread_u32_le(fh);
-	ASSERT(wavid == WAV_CHUNK_ID("WAVE"), "No WAVE id found");
-
-	uint32_t data_size = 0;
-	uint32_t format_length = 0;
-	uint32_t format_type = 0;
-	uint32_t channels = 0;
-	uint32_t samplerate = 0;
-	uint32_t byte_rate = 0;
-	uint32_t block_align = 0;
-	uint32_t bits_per_sample = 0;
-
-	// Find the fmt and data chunk, skip all others
-	while (1) {
-		uint32_t chunk_type = fread_u32_le(fh);
-		uint32_t chunk_size = fread_u32_le(fh);
-
-		if (chunk_type == WAV_CHUNK_ID("fmt ")) {
-			ASSERT(chunk_size == 16 || chunk_size == 18, "WAV fmt chunk size missmatch");
-
-			format_type = fread_u16_le(fh);
-			channels = fread_u16_le(fh);
-			samplerate = fread_u32_le(fh);
-			byte_rate = fread_u32_le(fh);
-			block_align = fread_u16_le(fh);
-			bits_per_sample = fread_u16_le(fh);
-
-			if (chunk_size == 18) {
-				unsigned short extra_params = fread_u16_le(fh);
-				ASSERT(extra_params == 0, "WAV fmt extra params not supported");
+			char misses[3][16];
+			for (int e = 0; e < 3; e++) {
+				if (values[2 + e] < 0) {
+					snprintf(misses[e], sizeof(misses[e]), "n/a");
+				}
+				else {
+					snprintf(misses[e], sizeof(misses[e]), "%.4f", values[2 + e] / samples);
+				}
 			}
+			printf(
+				"%-10s %12.0f %12.0f %6.2f %15s %15s %15s\n", perf_stage_names[s], 
+				values[0], values[1], values[1] >= 0 && values[0] > 0 ? values[1] / values[0] : 0,
+				misses[0], misses[1], misses[2]
+			);
 		}
-		else if (chunk_type == WAV_CHUNK_ID("data")) {
-			data_size = chunk_size;
-			break;
-		}
-		else {
-			int seek_result = fseek(fh, chunk_size, SEEK_CUR);
-			ASSERT(seek_result == 0, "Malformed RIFF header");
-		}
 	}
+#else
+	void perf_init(void) {
+		ABORT("--perf is only supported on Linux");
+	}
+	void perf_report(int samples) {}
+#endif
 
-	ASSERT(format_type == 1, "Type in fmt chunk is not PCM");
-	ASSERT(bits_per_sample == 16, "Bits per samples != 16");
-	ASSERT(data_size, "No data chunk");
+/* --mem-report: allocations and peak heap use of the codec for the read and
+the write operation, relative to the size of each operation's input (the 
+input file for read, the decoded samples for write), and the peak resident 
+set size of the process. */
 
-	uint8_t *wav_bytes = malloc(data_size);
-	ASSERT(wav_bytes, "Malloc for %d bytes failed", data_size);
-	int read = fread(wav_bytes, data_size, 1, fh);
-	ASSERT(read, "Read error or unexpected end of file for %d bytes", data_size);
-	fclose(fh);
+#if defined(__unix__) || defined(__APPLE__)
+	#include <sys/resource.h>
+#endif
 
-	desc->samplerate = samplerate;
-	desc->samples = data_size / (channels * (bits_per_sample/8));
-	desc->channels = channels;
+typedef struct {
+	uint64_t allocated;
+	uint64_t peak;
+} mem_op_t;
 
-	return (short*)wav_bytes;
+static void mem_begin(void) {
+	brainwire_mem.peak = brainwire_mem.current;
+	brainwire_mem.total = 0;
 }
 
+static mem_op_t mem_end(uint64_t base) {
+	mem_op_t op = {brainwire_mem.total, brainwire_mem.peak - base};
+	return op;
+}
 
+static uint64_t mem_file_size(const char *path) {
+	FILE *fh = fopen(path, "rb");
+	ASSERT(fh, "Can't open %s for reading", path);
+	fseek(fh, 0, SEEK_END);
+	uint64_t size = ftell(fh);
+	fclose(fh);
+	return size;
+}
 
-/* -----------------------------------------------------------------------------
-	BRAINWIRE reader / writer */
-
-static inline int rice_read(uint8_t *bytes, int *bit_pos, uint32_t k) {
-	int msbs = 0;
-	int p = *bit_pos;
-	while (!(bytes[p >> 3] & (1 << (7-(p & 7))))) {
-		p++;
-		msbs++;
-	}
-	p++;
-
-	int count = k;
-	int lsbs = 0;
-	while (count) {
-		int remaining = 8 - (p & 7);
-		int read = remaining < count ? remaining : count;
-		int shift = remaining - read;
-		int mask = (0xff >> (8 - read));
-		lsbs = (lsbs << read) | ((bytes[p >> 3] & (mask << shift)) >> shift);
-		p += read;
-		count -= read;
-	}
-	*bit_pos = p;
-
-	int val;
-	uint32_t uval = (msbs << k) | lsbs;
-	if (uval & 1) {
-		val = -((int)(uval >> 1)) - 1;
-	}
-	else {
-		val = (int)(uval >> 1);
-	}
+static void mem_report(const char *name, mem_op_t *op, uint64_t input_size) {
+	double per_byte = input_size ? 1.0 / input_size : 0;
+	printf(
+		"mem %-5s allocated %llu bytes (%.3f/input byte), peak %llu bytes (%.3f/input byte)\n", 
+		name, (unsigned long long)op->allocated, op->allocated * per_byte, 
+		(unsigned long long)op->peak, op->peak * per_byte
+	);
+}
 
-	return val;
+static void mem_report_rss(void) {
+	#if defined(__unix__) || defined(__APPLE__)
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		#ifdef __APPLE__
+			long kb = usage.ru_maxrss / 1024; // bytes on macOS
+		#else
+			long kb = usage.ru_maxrss;
+		#endif
+		printf("mem peak RSS %ld kb\n", kb);
+	#endif
 }
 
-static inline int rice_write(uint8_t *bytes, int *bit_pos, int val, uint32_t k) {
-	uint32_t uval = val;
-	uval <<= 1;
-	uval ^= (val >> 31);
-
-	uint32_t msbs = uval >> k;
-	uint32_t lsbs = 1 + k;
-	uint32_t count = msbs + lsbs;
-	uint32_t pattern = 1 << k; // the unary end bit
-	pattern |= (uval & ((1 << k)-1)); // the binary LSBs
-
-	int pos = *bit_pos;
-	while (count) {
-		int occupied = (pos & 7);
-		int remaining = 8 - occupied;
-		int written = remaining < count ? remaining : count;
-		int bits = 0;
-		if (count - written < 31) {
-			bits = (pattern >> (count - written)) << (remaining - written);
-			bits &= (0xff >> occupied);
-		}
-		bytes[pos >> 3] |= bits;
-		pos += written;
-		count -= written;
-	}
-	*bit_pos = pos;
-	return msbs + lsbs;
+
+/* --index, -j, --range: decode a v1 or framed stream with its checkpoint 
+index (see "Checkpoint index" in brainwire.h), split at the checkpoints into
+one range per thread (-j), or only the samples of --range. Without --index,
+the index is built in memory first; for a framed stream, this only reads
+the frame table. */
+
+#include <pthread.h>
+
+typedef struct {
+	uint8_t *bytes;
+	int size;
+	brainwire_index_t *index;
+	int first;
+	int count;
+	short *sample_data;
+	int ok;
+	pthread_t thread;
+} range_job_t;
+
+static void *range_job_run(void *arg) {
+	range_job_t *job = arg;
+	job->ok = brainwire_decode_range(job->bytes, job->size, job->index, job->first, job->count, job->sample_data);
+	return NULL;
 }
 
+// Decodes count samples (or all from first on, for -1) of the stream at path
+static short *read_indexed(const char *path, const char *index_path, int interval, int threads, int first, int count, samples_t *desc) {
+	int size;
+	uint8_t *bytes = brainwire_load(path, &size);
+	ASSERT(bytes, "Can't load %s: %s", path, brainwire_error);
+	brainwire_index_t *index = index_path 
+		? brainwire_index_read(index_path)
+		: brainwire_index(bytes, size, interval);
+	ASSERT(index, "Can't index %s: %s", index_path ? index_path : path, brainwire_error);
+
+	brainwire_stream_t header = {.bytes = bytes, .end = (int64_t)size * 8};
+	ASSERT(!brainwire_read_header(&header), "Can't decode %s: invalid header", path);
+	if (count < 0) {
+		count = header.samples - first;
+	}
+	ASSERT(first >= 0 && count >= 0 && first <= header.samples - count, "Range exceeds the %d samples of %s", header.samples, path);
+
+	// Whole checkpoint intervals per thread; only the first job decodes 
+	// samples before its range
+	interval = index->interval;
+	int end = first + count;
+	int intervals = count ? (end - 1) / interval - first / interval + 1 : 0;
+	int per_job = intervals ? (intervals + threads - 1) / threads : 1;
+	short *sample_data = brainwire_malloc(count * sizeof(short));
+	range_job_t *jobs = brainwire_calloc(threads, sizeof(range_job_t));
+	int num_jobs = 0;
+	for (int pos = first; pos < end; num_jobs++) {
+		int job_end = (pos / interval + per_job) * interval;
+		job_end = job_end < end ? job_end : end;
+		jobs[num_jobs] = (range_job_t){
+			.bytes = bytes,
+			.size = size,
+			.index = index,
+			.first = pos,
+			.count = job_end - pos,
+			.sample_data = sample_data + pos - first
+		};
+		pos = job_end;
+	}
 
-static inline int brainwire_dequant(int v) {
-	// Not really sure what's goin on here. The original 10bit data was 
-	// upscaled to 16 bit somehow. It wasn't a simple bit shift. This thing
-	// here was found through a brute force search and just happens to 
-	// replicate neuralink's original upscale.
-	if (v >= 0) {
-		return round(v * 64.061577 + 31.034184);
+	for (int i = 1; i < num_jobs; i++) {
+		ASSERT(pthread_create(&jobs[i].thread, NULL, range_job_run, &jobs[i]) == 0, "Can't create thread");
 	}
-	else {
-		return -round((-v -1) * 64.061577 + 31.034184) - 1;
+	if (num_jobs) {
+		range_job_run(&jobs[0]);
+	}
+	for (int i = 1; i < num_jobs; i++) {
+		pthread_join(jobs[i].thread, NULL);
+	}
+	for (int i = 0; i < num_jobs; i++) {
+		ASSERT(jobs[i].ok, "Can't decode %s: %s", path, brainwire_error);
 	}
-}
 
-static inline int brainwire_quant(int v) {
-	return (int)floor(v/64.0);
+	brainwire_free(jobs);
+	brainwire_free(index);
+	brainwire_free(bytes);
+	desc->channels = 1;
+	desc->samplerate = header.samplerate;
+	desc->samples = count;
+	return sample_data;
 }
 
-short *brainwire_read(const char *path, samples_t *desc) {
-	FILE *fh = fopen(path, "rb");
-	ASSERT(fh, "Couldnt open %s for reading", path);
+/* transcode: the files are handed out to -j threads, which each decode a 
+file to its quantized values (BRAINWIRE_FORMAT_CODES) and encode these as a
+framed stream. */
 
-	fseek(fh, 0, SEEK_END);
-	int size = ftell(fh);
-	fseek(fh, 0, SEEK_SET);
+#include <time.h>
 
-	uint8_t *bytes = malloc(size);
-	int bytes_read = fread(bytes, 1, size, fh);
-	ASSERT(size > 0 && bytes_read == size, "Read failed");
-	fclose(fh);
+typedef struct {
+	char **paths;
+	int count;
+	const char *out_dir;
+	brainwire_opts_t *opts;
+	pthread_mutex_t lock;
+	int next;
+	int failed;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t samples;
+} transcode_t;
+
+static void *transcode_run(void *arg) {
+	transcode_t *t = arg;
+	for (;;) {
+		pthread_mutex_lock(&t->lock);
+		int i = t->next++;
+		pthread_mutex_unlock(&t->lock);
+		if (i >= t->count) {
+			return NULL;
+		}
 
+		const char *in_path = t->paths[i];
+		const char *name = strrchr(in_path, '/') ? strrchr(in_path, '/') + 1 : in_path;
+		char out_path[4096];
+		snprintf(out_path, sizeof(out_path), "%s/%s", t->out_dir, name);
+
+		int size = 0;
+		int bytes_written = 0;
+		samples_t desc = {0};
+		short *codes = NULL;
+		uint8_t *bytes = NULL;
+		if (strcmp(out_path, in_path) == 0) {
+			brainwire_error = "Would overwrite the input";
+		}
+		else {
+			bytes = brainwire_load(in_path, &size);
+		}
+		if (bytes) {
+			brainwire_opts_t decode_opts = {.format = BRAINWIRE_FORMAT_CODES};
+			codes = brainwire_decode(bytes, size, &desc, &decode_opts);
+			brainwire_free(bytes);
+		}
+		if (codes) {
+			brainwire_opts_t encode_opts = *t->opts;
+			encode_opts.format = BRAINWIRE_FORMAT_CODES;
+			bytes_written = brainwire_write(out_path, codes, &desc, &encode_opts);
+			brainwire_free(codes);
+		}
 
-	int bit_pos = 0;
-	float rice_k = 3;
+		pthread_mutex_lock(&t->lock);
+		if (bytes_written) {
+			printf("%s: %d -> %d bytes\n", out_path, size, bytes_written);
+			t->bytes_in += size;
+			t->bytes_out += bytes_written;
+			t->samples += desc.samples;
+		}
+		else {
+			printf("Can't transcode %s: %s\n", in_path, brainwire_error);
+			t->failed++;
+		}
+		pthread_mutex_unlock(&t->lock);
+	}
+}
 
-	int samples = rice_read(bytes, &bit_pos, 16);
-	int samplerate = rice_read(bytes, &bit_pos, 16);
-	short *sample_data = malloc(samples * sizeof(short));
+static double transcode_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-	int prev_quantized = 0;
-	for (int i = 0; i < samples; i++) {
-		int temp = bit_pos;
+static int transcode(const char *out_dir, char **paths, int count, int threads, brainwire_opts_t *opts) {
+	for (int i = 0; i < count; i++) {
+		ASSERT(STR_ENDS_WITH(paths[i], ".bw"), "Can only transcode .bw files, not %s", paths[i]);
+	}
 
-		int residual = rice_read(bytes, &bit_pos, rice_k);
-		int quantized = prev_quantized + residual;
-		prev_quantized = quantized;
-		sample_data[i] = brainwire_dequant(quantized);
+	transcode_t t = {.paths = paths, .count = count, .out_dir = out_dir, .opts = opts};
+	pthread_mutex_init(&t.lock, NULL);
+	threads = threads < count ? threads : count;
+	pthread_t *workers = brainwire_calloc(threads, sizeof(pthread_t));
 
-		int encoded_len = bit_pos - temp;
-		rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+	double start = transcode_now();
+	for (int i = 1; i < threads; i++) {
+		ASSERT(pthread_create(&workers[i], NULL, transcode_run, &t) == 0, "Can't create thread");
 	}
+	transcode_run(&t);
+	for (int i = 1; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	double elapsed = transcode_now() - start;
 
-	desc->channels = 1;
-	desc->samples = samples;
-	desc->samplerate = samplerate;
-	return sample_data;
+	printf(
+		"transcoded %d files on %d threads in %.3f s: %.2f MB -> %.2f MB, "
+		"%.1f MB/s, %.1f Msamples/s\n", 
+		count - t.failed, threads, elapsed, t.bytes_in / 1e6, t.bytes_out / 1e6, 
+		elapsed > 0 ? t.bytes_in / 1e6 / elapsed : 0,
+		elapsed > 0 ? t.samples / 1e6 / elapsed : 0
+	);
+	brainwire_free(workers);
+	pthread_mutex_destroy(&t.lock);
+	return t.failed ? 1 : 0;
 }
 
-int brainwire_write(const char *path, short *sample_data, samples_t *desc) {
-	uint8_t *bytes = malloc(desc->samples * 2); // just to be sure...
-	memset(bytes, 0, desc->samples * 2);
-
-	int bit_pos = 0;
-	float rice_k = 3;
+// Reads count samples from first on of a .bw10 file, found by their offset
+static void *read_bw10_range(const char *path, int first, int count, int format, samples_t *desc) {
+	int size;
+	uint8_t *bytes = brainwire_load(path, &size);
+	ASSERT(bytes, "Can't load %s: %s", path, brainwire_error);
+	void *sample_data = brainwire_malloc((size_t)count * brainwire_sample_size(format));
+	if (!brainwire_bw10_decode(bytes, size, desc, first, count, sample_data, format)) {
+		brainwire_free(sample_data);
+		sample_data = NULL;
+	}
+	desc->samples = count;
+	brainwire_free(bytes);
+	return sample_data;
+}
 
-	rice_write(bytes, &bit_pos, desc->samples, 16);
-	rice_write(bytes, &bit_pos, desc->samplerate, 16);
-	
-	int prev_quantized = 0;
-	for (int i = 0; i < desc->samples; i++) {
-		int quantized = brainwire_quant(sample_data[i]);
-		int residual = quantized - prev_quantized;
-		prev_quantized = quantized;
+// Returns the number of bytes written, or 0 on failure
+static int raw_write(const char *path, void *data, int size) {
+	FILE *fh = fopen(path, "wb");
+	int ok = fh && (size == 0 || fwrite(data, size, 1, fh) == 1);
+	if (fh) {
+		ok &= fclose(fh) == 0;
+	}
+	if (!ok) {
+		brainwire_error = fh ? "Write error" : "Can't open file for writing";
+		return 0;
+	}
+	return size;
+}
 
-		int encoded_len = rice_write(bytes, &bit_pos, residual, rice_k);
-		rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+int main(int argc, char **argv) {
+	brainwire_opts_t opts = {0};
+	const char *stats_path = NULL;
+	int perf = 0;
+	int mem = 0;
+	const char *index_path = NULL;
+	int interval = BRAINWIRE_INDEX_INTERVAL;
+	int threads = 1;
+	int range_first = 0;
+	int range_count = -1;
+
+	int transcoding = argc > 1 && strcmp(argv[1], "transcode") == 0;
+	if (transcoding) {
+		opts.flags |= BRAINWIRE_FLAG_FRAMES;
+		argv += 1;
+		argc -= 1;
 	}
 
-	int byte_len = (bit_pos + 7) / 8;
-	FILE *fh = fopen(path, "wb");
-	ASSERT(fh, "Couldnt open %s for writing", path);
-	fwrite(bytes, 1, byte_len, fh);
-	fclose(fh);
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-n") == 0 && argc > 2) {
+			opts.flags |= BRAINWIRE_FLAG_HUM;
+			opts.mains_hz = atoi(argv[2]);
+			ASSERT(opts.mains_hz == 50 || opts.mains_hz == 60, "Mains frequency must be 50 or 60");
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "-w") == 0) {
+			opts.flags |= BRAINWIRE_FLAG_WAVELET;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "-s") == 0) {
+			opts.flags |= BRAINWIRE_FLAG_SPIKES;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "-t") == 0 && argc > 2) {
+			opts.spikes_path = argv[2];
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "--perf") == 0) {
+			perf = 1;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "--turbo") == 0) {
+			opts.flags |= BRAINWIRE_FLAG_TURBO;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "--verify") == 0) {
+			opts.verify = 1;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "--mem-report") == 0) {
+			mem = 1;
+			argv += 1;
+			argc -= 1;
+		}
+		else if (strcmp(argv[1], "--stats") == 0 && argc > 2) {
+			#ifdef BRAINWIRE_NO_STATS
+				ABORT("Compiled without stats support");
+			#endif
+			stats_path = argv[2];
+			opts.stats = brainwire_stats_create();
+			ASSERT(opts.stats, "Can't allocate stats: %s", brainwire_error);
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "-p") == 0 && argc > 2) {
+			opts.preview_level = atoi(argv[2]);
+			ASSERT(opts.preview_level >= 0, "Invalid preview level");
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "--index") == 0 && argc > 2) {
+			index_path = argv[2];
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "--frames") == 0 && argc > 2) {
+			opts.flags |= BRAINWIRE_FLAG_FRAMES;
+			opts.frame_len = atoi(argv[2]);
+			ASSERT(opts.frame_len > 0 && opts.frame_len % BRAINWIRE_BLOCK == 0, "Frame length must be a multiple of %d", BRAINWIRE_BLOCK);
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "--interval") == 0 && argc > 2) {
+			interval = atoi(argv[2]);
+			ASSERT(interval > 0, "Invalid checkpoint interval");
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+			threads = atoi(argv[2]);
+			ASSERT(threads > 0, "Invalid number of threads");
+			argv += 2;
+			argc -= 2;
+		}
+		else if (strcmp(argv[1], "--range") == 0 && argc > 2) {
+			ASSERT(sscanf(argv[2], "%d:%d", &range_first, &range_count) == 2 && range_count >= 0, "Invalid range %s", argv[2]);
+			argv += 2;
+			argc -= 2;
+		}
+		else {
+			ABORT("Unknown option %s", argv[1]);
+		}
+	}
 
-	return byte_len;
-}
+	ASSERT(argc >= 3, 
+		"\nUsage: bwenc [-n 50|60] [-w] [-s] [-p level] [-t out.csv] [--turbo] [--perf] [--mem-report] [--stats out.json] [--verify] [--frames samples] [--index in.bwi] [-j threads] [--range first:count] [--interval samples] in.{wav,bw,bw10} out.{wav,bw,bwi,bw10,f32,f16}"
+		"\n       bwenc transcode [-j threads] [-n 50|60] [-s] [--turbo] [--frames samples] [--verify] out_dir in1.bw in2.bw ..."
+	);
+	ASSERT(!(perf && threads > 1), "--perf can't count multiple threads");
 
+	// The library silently falls back to the best set. Selected up front, 
+	// since the parallel decoder calls into the library from several threads.
+	const char *isa = getenv("BRAINWIRE_ISA");
+	ASSERT(brainwire_kernels_select(isa), "BRAINWIRE_ISA=%s is unknown or not supported by this CPU", isa);
 
+	if (transcoding) {
+		ASSERT(!(opts.flags & BRAINWIRE_FLAG_WAVELET), "Can't transcode to a progressive stream");
+		ASSERT(!perf && !stats_path, "--perf and --stats are not supported for transcode");
+		return transcode(argv[1], argv + 2, argc - 2, threads, &opts);
+	}
 
-/* -----------------------------------------------------------------------------
-	Main */
+	// Write the checkpoint index of a stream
+	if (STR_ENDS_WITH(argv[2], ".bwi")) {
+		ASSERT(STR_ENDS_WITH(argv[1], ".bw"), "A checkpoint index can only be built for a .bw file");
+		int size;
+		uint8_t *bytes = brainwire_load(argv[1], &size);
+		ASSERT(bytes, "Can't load %s: %s", argv[1], brainwire_error);
+		brainwire_index_t *index = brainwire_index(bytes, size, interval);
+		ASSERT(index, "Can't index %s: %s", argv[1], brainwire_error);
+		int bytes_written = brainwire_index_write(argv[2], index);
+		ASSERT(bytes_written, "Can't write %s: %s", argv[2], brainwire_error);
+		printf(
+			"%s: %d checkpoints every %d samples, %d bytes\n", 
+			argv[2], index->count, index->interval, bytes_written
+		);
+		brainwire_free(index);
+		brainwire_free(bytes);
+		return 0;
+	}
 
-int main(int argc, char **argv) {
-	ASSERT(argc >= 3, "\nUsage: bwenc in.{wav,bw} out.{wav,bw}")
+	// Raw float outputs are decoded to the format directly. Between .bw and
+	// .bw10, the codes are passed on as they are.
+	int bw10_in = STR_ENDS_WITH(argv[1], ".bw10");
+	int indexed = STR_ENDS_WITH(argv[1], ".bw") && (index_path || threads > 1 || range_count >= 0);
+	if (STR_ENDS_WITH(argv[2], ".f32") || STR_ENDS_WITH(argv[2], ".f16")) {
+		ASSERT(STR_ENDS_WITH(argv[1], ".bw") || bw10_in, "Only .bw and .bw10 files can be decoded to %s", argv[2]);
+		ASSERT(!indexed, "--index, -j and --range on .bw files only decode to .wav, .bw and .bw10");
+		opts.format = STR_ENDS_WITH(argv[2], ".f32") ? BRAINWIRE_FORMAT_F32 : BRAINWIRE_FORMAT_F16;
+	}
+	else if (
+		((STR_ENDS_WITH(argv[1], ".bw") && !indexed) || bw10_in) && 
+		(STR_ENDS_WITH(argv[2], ".bw") || STR_ENDS_WITH(argv[2], ".bw10"))
+	) {
+		opts.format = BRAINWIRE_FORMAT_CODES;
+	}
+	ASSERT(!bw10_in || (!index_path && threads == 1), "--index and -j don't apply to .bw10 files");
 
 	samples_t desc;
-	short *sample_data = NULL;
+	void *sample_data = NULL;
+
+	if (perf) {
+		perf_init();
+	}
 
 	// Decode input
 
+	uint64_t mem_base = brainwire_mem.current;
+	mem_begin();
 	if (STR_ENDS_WITH(argv[1], ".wav")) {
 		sample_data = wav_read(argv[1], &desc);
 	}
+	else if (indexed) {
+		sample_data = read_indexed(argv[1], index_path, interval, threads, range_first, range_count, &desc);
+	}
+	else if (bw10_in && range_count >= 0) {
+		sample_data = read_bw10_range(argv[1], range_first, range_count, opts.format, &desc);
+	}
+	else if (bw10_in) {
+		sample_data = brainwire_bw10_read(argv[1], &desc, &opts);
+	}
 	else if (STR_ENDS_WITH(argv[1], ".bw")) {
-		sample_data = brainwire_read(argv[1], &desc);
+		sample_data = brainwire_read(argv[1], &desc, &opts);
+
+		// Malformed streams may decode to codes beyond 10 bits, which the
+		// encoders reject. These are read again as samples and quantized.
+		if (sample_data && opts.format == BRAINWIRE_FORMAT_CODES && !brainwire_codes_in_range(sample_data, desc.samples)) {
+			brainwire_free(sample_data);
+			opts.format = BRAINWIRE_FORMAT_S16;
+			sample_data = brainwire_read(argv[1], &desc, &opts);
+		}
 	}
 	else {
 		ABORT("Unknown file type for %s", argv[1]);
 	}
 
-	ASSERT(sample_data, "Can't load/decode %s", argv[1]);
+	ASSERT(sample_data, "Can't load/decode %s: %s", argv[1], brainwire_error);
+	mem_op_t mem_read = mem_end(mem_base);
 
 
 	// Encode output
 	
 	int bytes_written = 0;
 	double psnr = 1.0/0.0;
+	mem_base = brainwire_mem.current;
+	mem_begin();
 	if (STR_ENDS_WITH(argv[2], ".wav")) {
 		bytes_written = wav_write(argv[2], sample_data, &desc);
 	}
 	else if (STR_ENDS_WITH(argv[2], ".bw")) {
-		bytes_written = brainwire_write(argv[2], sample_data, &desc);
+		bytes_written = brainwire_write(argv[2], sample_data, &desc, &opts);
+	}
+	else if (STR_ENDS_WITH(argv[2], ".bw10")) {
+		bytes_written = brainwire_bw10_write(argv[2], sample_data, &desc, &opts);
+	}
+	else if (opts.format == BRAINWIRE_FORMAT_F32 || opts.format == BRAINWIRE_FORMAT_F16) {
+		bytes_written = raw_write(argv[2], sample_data, desc.samples * brainwire_sample_size(opts.format));
 	}
 	else {
 		ABORT("Unknown file type for %s", argv[2]);
 	}
 
-	ASSERT(bytes_written, "Can't write/encode %s", argv[2]);
-	free(sample_data);
+	ASSERT(bytes_written, "Can't write/encode %s: %s", argv[2], brainwire_error);
+	mem_op_t mem_write = mem_end(mem_base);
+	brainwire_free(sample_data);
+
+	if (stats_path) {
+		ASSERT(brainwire_stats_write(opts.stats, stats_path), "Can't open %s for writing", stats_path);
+		brainwire_stats_free(opts.stats);
+	}
 
 	printf(
 		"%s: size: %d kb (%d bytes) = %.2fx compression\n",
@@ -375,5 +745,34 @@ int main(int argc, char **argv) {
 		(float)(desc.samples * sizeof(short))/(float)bytes_written
 	);
 
+	if (perf) {
+		perf_report(desc.samples);
+	}
+
+	if (mem) {
+		mem_report("read", &mem_read, mem_file_size(argv[1]));
+		mem_report("write", &mem_write, (uint64_t)desc.samples * desc.channels * sizeof(short));
+		mem_report_rss();
+	}
+
+	#ifdef BRAINWIRE_LATENCY
+		const char *names[] = {"encode", "decode"};
+		for (int i = 0; i < 2; i++) {
+			brainwire_latency_t *lat = &brainwire_latency[i];
+			if (lat->total) {
+				printf(
+					"%s cycles/sample: p50 %llu, p99 %llu, p99.9 %llu, max %llu\n", 
+					names[i], 
+					(unsigned long long)brainwire_latency_percentile(lat, 50),
+					(unsigned long long)brainwire_latency_percentile(lat, 99),
+					(unsigned long long)brainwire_latency_percentile(lat, 99.9),
+					(unsigned long long)lat->max
+				);
+			}
+		}
+	#endif
+
 	return 0;
 }
+
+#endif // BWENC_NO_MAIN
@@ -0,0 +1,117 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+libFuzzer target for the WAV and BRAINWIRE readers
+
+Inputs starting with "RIFF" go to wav_read_fh(), those starting with "BW10"
+to brainwire_bw10_decode(), all others to brainwire_decode() and, for v1
+streams, to brainwire_index() and brainwire_decode_range(). The codes of 
+decodable streams are encoded again as a framed stream, like 
+`bwenc transcode` does. None may crash, hang, exit or read out of bounds.
+
+Compile and run with:
+	clang bwfuzz.c -std=c99 -g -O1 -fsanitize=fuzzer,address,undefined -lm -o bwfuzz
+	./bwfuzz -max_len=65536 corpus/ fuzz/crashes/
+
+Seed corpus/ with a few small .wav, .bw and .bw10 files. fuzz/crashes contains
+inputs that crashed, hung or aborted earlier versions of the readers.
+
+Without libFuzzer, -DBWFUZZ_MAIN adds a main() that runs each given file once,
+e.g. to replay the crash corpus with gcc:
+	gcc bwfuzz.c -std=c99 -g -O1 -fsanitize=address,undefined -DBWFUZZ_MAIN -lm -o bwfuzz
+	./bwfuzz fuzz/crashes/*
+
+*/
+
+#define _POSIX_C_SOURCE 200809L // for fmemopen()
+#define BWENC_NO_MAIN
+#include "bwenc.c"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	samples_t desc;
+	short *sample_data;
+
+	if (size >= 4 && memcmp(data, "RIFF", 4) == 0) {
+		FILE *fh = fmemopen((void *)data, size, "rb");
+		sample_data = wav_read_fh(fh, &desc);
+		fclose(fh);
+	}
+	else if (size >= 4 && memcmp(data, "BW10", 4) == 0) {
+		// The SIMD unpacking reads up to 6 bytes past the codes, into the 
+		// padding that brainwire_load() adds
+		uint8_t *bytes = brainwire_malloc(size + BRAINWIRE_PADDING);
+		memcpy(bytes, data, size);
+		memset(bytes + size, 0xff, BRAINWIRE_PADDING);
+
+		// Unpack all samples, then a few from an unaligned position in each
+		// of the other formats
+		samples_t header;
+		sample_data = NULL;
+		if (brainwire_bw10_decode(bytes, size, &header, 0, 0, NULL, BRAINWIRE_FORMAT_S16)) {
+			sample_data = brainwire_malloc((size_t)header.samples * sizeof(short));
+			brainwire_bw10_decode(bytes, size, &desc, 0, header.samples, sample_data, BRAINWIRE_FORMAT_S16);
+
+			float range[64];
+			int first = header.samples / 3;
+			int count = header.samples - first < 64 ? header.samples - first : 64;
+			for (int format = BRAINWIRE_FORMAT_CODES; format <= BRAINWIRE_FORMAT_F16; format++) {
+				brainwire_bw10_decode(bytes, size, &desc, first, count, range, format);
+			}
+		}
+		brainwire_free(bytes);
+	}
+	else {
+		uint8_t *bytes = brainwire_malloc(size + BRAINWIRE_PADDING);
+		memcpy(bytes, data, size);
+		memset(bytes + size, 0xff, BRAINWIRE_PADDING);
+
+		brainwire_opts_t opts = {0};
+		sample_data = brainwire_decode(bytes, size, &desc, &opts);
+
+		// Index v1 streams and decode a few samples from the last checkpoint
+		brainwire_index_t *index = brainwire_index(bytes, size, BRAINWIRE_BLOCK);
+		if (index && index->samples) {
+			short range[64];
+			int count = index->samples < 64 ? index->samples : 64;
+			brainwire_decode_range(bytes, size, index, index->samples - count, count, range);
+		}
+		brainwire_free(index);
+
+		// Transcode the codes, which may exceed 10 bits in malformed streams
+		brainwire_opts_t codes_opts = {.format = BRAINWIRE_FORMAT_CODES};
+		short *codes = sample_data ? brainwire_decode(bytes, size, &desc, &codes_opts) : NULL;
+		if (codes) {
+			brainwire_opts_t transcode_opts = {.flags = BRAINWIRE_FLAG_FRAMES, .format = BRAINWIRE_FORMAT_CODES};
+			int len;
+			brainwire_free(brainwire_encode(codes, &desc, &transcode_opts, &len));
+		}
+		brainwire_free(codes);
+		brainwire_free(bytes);
+	}
+
+	brainwire_free(sample_data);
+	return 0;
+}
+
+#ifdef BWFUZZ_MAIN
+int main(int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+		FILE *fh = fopen(argv[i], "rb");
+		ASSERT(fh, "Can't open %s for reading", argv[i]);
+		fseek(fh, 0, SEEK_END);
+		long size = ftell(fh);
+		fseek(fh, 0, SEEK_SET);
+
+		uint8_t *data = malloc(size);
+		ASSERT(size == 0 || fread(data, size, 1, fh), "Read error");
+		fclose(fh);
+
+		LLVMFuzzerTestOneInput(data, size);
+		printf("%s: ok\n", argv[i]);
+		free(data);
+	}
+	return 0;
+}
+#endif
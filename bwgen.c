@@ -0,0 +1,236 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+Deterministic generator for synthetic neural recordings
+
+Compile with:
+	gcc bwgen.c -std=c99 -lm -O3 -o bwgen
+
+Usage:
+	./bwgen [options] out.wav
+
+Options:
+	-seed n      random seed (default 1); the same seed and options always
+	             produce the same file
+	-c n         channels (default 1)
+	-r hz        samplerate (default 19531, as the challenge data)
+	-d seconds   duration (default 5)
+	-noise a     amplitude of the colored background noise (default 4)
+	-spikes hz   mean firing rate per unit, 3 units per channel (default 20)
+	-hum hz      mains frequency, 0 for none (default 50)
+	-hum-amp a   amplitude of the mains hum (default 6)
+	-dropouts hz mean rate of dropouts (default 0.2)
+
+All amplitudes are in units of the 10 bit quantization lattice. The signal is
+the sum of pink-ish noise, a slow local field potential, biphasic spikes of
+units with fixed per-unit waveforms, and mains hum with its 3rd harmonic.
+During a dropout (1-50ms) the signal holds its last value. The result is
+clamped to 10 bit and upscaled with brainwire_dequant(), so it lies on the
+same lattice as the challenge data and every file round trips losslessly.
+
+Samples are generated and written in chunks, so files up to the 4GB WAV
+limit can be produced with constant memory.
+
+*/
+
+#define BWENC_NO_MAIN
+#include "bwenc.c"
+
+#ifndef M_PI
+	#define M_PI 3.14159265358979323846
+#endif
+
+#define GEN_CHUNK 4096
+#define GEN_UNITS 3
+#define GEN_SPIKE_LEN 48
+#define GEN_MAX_CHANNELS 1024
+
+typedef struct {
+	uint64_t state;
+} gen_rand_t;
+
+// splitmix64
+static uint64_t gen_rand(gen_rand_t *r) {
+	uint64_t z = (r->state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static double gen_uniform(gen_rand_t *r) {
+	return (gen_rand(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double gen_gauss(gen_rand_t *r) {
+	double u = gen_uniform(r) + 1e-12;
+	double v = gen_uniform(r);
+	return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+typedef struct {
+	gen_rand_t rand;
+	double pink[3];
+	double lfp;
+	double lfp_vel;
+	double hum_phase;
+	double hum_amp;
+	float waveforms[GEN_UNITS][GEN_SPIKE_LEN];
+	int spike_unit;
+	int spike_pos;
+	double spike_amp;
+	int dropout_left;
+	int last;
+} gen_channel_t;
+
+typedef struct {
+	int samplerate;
+	double noise;
+	double spike_rate;
+	double hum_hz;
+	double hum_amp;
+	double dropout_rate;
+} gen_params_t;
+
+static void gen_channel_init(gen_channel_t *ch, uint64_t seed, int channel, gen_params_t *p) {
+	memset(ch, 0, sizeof(gen_channel_t));
+	ch->rand.state = seed * 0x100000001b3ull + channel;
+	ch->spike_pos = -1;
+	ch->hum_phase = gen_uniform(&ch->rand) * 2.0 * M_PI;
+	ch->hum_amp = p->hum_amp * (0.5 + gen_uniform(&ch->rand));
+
+	// Biphasic waveforms: a sharp negative peak followed by a slower positive
+	// rebound, with per-unit width, amplitude and rebound ratio
+	for (int u = 0; u < GEN_UNITS; u++) {
+		double amp = 40 + gen_uniform(&ch->rand) * 120;
+		double width = 1.0 + gen_uniform(&ch->rand) * 1.5;
+		double rebound = 0.2 + gen_uniform(&ch->rand) * 0.4;
+		for (int i = 0; i < GEN_SPIKE_LEN; i++) {
+			double t = (i - 6) / (width * p->samplerate / 19531.0);
+			double neg = exp(-t * t);
+			double pos = exp(-(t - 4) * (t - 4) / 8);
+			ch->waveforms[u][i] = amp * (rebound * pos - neg);
+		}
+	}
+}
+
+static int gen_channel_sample(gen_channel_t *ch, gen_params_t *p) {
+	gen_rand_t *r = &ch->rand;
+
+	if (ch->dropout_left > 0) {
+		ch->dropout_left--;
+		return ch->last;
+	}
+	if (gen_uniform(r) < p->dropout_rate / p->samplerate) {
+		ch->dropout_left = (0.001 + gen_uniform(r) * 0.049) * p->samplerate;
+	}
+
+	// Colored noise: sum of three one-pole filtered white noise sources
+	double white = gen_gauss(r);
+	ch->pink[0] = 0.99 * ch->pink[0] + 0.10 * white;
+	ch->pink[1] = 0.90 * ch->pink[1] + 0.30 * white;
+	ch->pink[2] = 0.50 * ch->pink[2] + 0.60 * white;
+	double v = p->noise * (ch->pink[0] + ch->pink[1] + ch->pink[2] + 0.5 * white) * 0.5;
+
+	// Local field potential: damped oscillator driven by noise
+	ch->lfp_vel = 0.999 * ch->lfp_vel - 0.0005 * ch->lfp + 0.05 * gen_gauss(r);
+	ch->lfp += ch->lfp_vel;
+	v += ch->lfp;
+
+	if (ch->spike_pos < 0 && gen_uniform(r) < p->spike_rate * GEN_UNITS / p->samplerate) {
+		ch->spike_unit = gen_rand(r) % GEN_UNITS;
+		ch->spike_amp = 0.8 + gen_uniform(r) * 0.4;
+		ch->spike_pos = 0;
+	}
+	if (ch->spike_pos >= 0) {
+		v += ch->spike_amp * ch->waveforms[ch->spike_unit][ch->spike_pos];
+		if (++ch->spike_pos == GEN_SPIKE_LEN) {
+			ch->spike_pos = -1;
+		}
+	}
+
+	if (p->hum_hz > 0) {
+		v += ch->hum_amp * (sin(ch->hum_phase) + 0.3 * sin(3 * ch->hum_phase));
+		ch->hum_phase += 2.0 * M_PI * p->hum_hz / p->samplerate;
+		if (ch->hum_phase > 2.0 * M_PI) {
+			ch->hum_phase -= 2.0 * M_PI;
+		}
+	}
+
+	int q = (int)floor(v);
+	ch->last = q < -512 ? -512 : (q > 511 ? 511 : q);
+	return ch->last;
+}
+
+int main(int argc, char **argv) {
+	uint64_t seed = 1;
+	int channels = 1;
+	double duration = 5;
+	gen_params_t params = {
+		.samplerate = 19531,
+		.noise = 4,
+		.spike_rate = 20,
+		.hum_hz = 50,
+		.hum_amp = 6,
+		.dropout_rate = 0.2
+	};
+
+	while (argc > 2 && argv[1][0] == '-') {
+		const char *opt = argv[1];
+		double v = atof(argv[2]);
+		if (strcmp(opt, "-seed") == 0) { seed = strtoull(argv[2], NULL, 10); }
+		else if (strcmp(opt, "-c") == 0) { channels = v; }
+		else if (strcmp(opt, "-r") == 0) { params.samplerate = v; }
+		else if (strcmp(opt, "-d") == 0) { duration = v; }
+		else if (strcmp(opt, "-noise") == 0) { params.noise = v; }
+		else if (strcmp(opt, "-spikes") == 0) { params.spike_rate = v; }
+		else if (strcmp(opt, "-hum") == 0) { params.hum_hz = v; }
+		else if (strcmp(opt, "-hum-amp") == 0) { params.hum_amp = v; }
+		else if (strcmp(opt, "-dropouts") == 0) { params.dropout_rate = v; }
+		else {
+			ABORT("Unknown option %s", opt);
+		}
+		argv += 2;
+		argc -= 2;
+	}
+
+	ASSERT(argc == 2, "\nUsage: bwgen [options] out.wav");
+	ASSERT(channels > 0 && channels <= GEN_MAX_CHANNELS, "Invalid number of channels");
+	ASSERT(params.samplerate > 0, "Invalid samplerate");
+
+	double total = duration * params.samplerate;
+	ASSERT(total * channels * sizeof(short) < 4294967296.0 - 44, "Output exceeds the 4GB WAV limit");
+
+	samples_t desc = {
+		.channels = channels,
+		.samplerate = params.samplerate,
+		.samples = total
+	};
+
+	gen_channel_t *state = malloc(channels * sizeof(gen_channel_t));
+	for (int c = 0; c < channels; c++) {
+		gen_channel_init(&state[c], seed, c, &params);
+	}
+
+	FILE *fh = fopen(argv[1], "wb");
+	ASSERT(fh, "Can't open %s for writing", argv[1]);
+	wav_write_header(fh, &desc);
+
+	short *chunk = malloc(GEN_CHUNK * channels * sizeof(short));
+	for (uint32_t i = 0; i < desc.samples; i += GEN_CHUNK) {
+		int len = desc.samples - i < GEN_CHUNK ? desc.samples - i : GEN_CHUNK;
+		for (int s = 0; s < len; s++) {
+			for (int c = 0; c < channels; c++) {
+				chunk[s * channels + c] = brainwire_dequant(gen_channel_sample(&state[c], &params));
+			}
+		}
+		int wrote = fwrite(chunk, len * channels * sizeof(short), 1, fh);
+		ASSERT(wrote, "Write error");
+	}
+	fclose(fh);
+
+	free(chunk);
+	free(state);
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+
+Copyright (c) 2024, Dominic Szablewski - https://phoboslab.org
+SPDX-License-Identifier: MIT
+
+Reference implementation of the brainwire kernels
+
+These are the original scalar rice_read(), rice_write(), brainwire_quant() 
+and brainwire_dequant(), and the original v1 sample loops on top of them. 
+They are frozen: don't optimize or otherwise change them. bwcheck.c verifies
+that the kernels in brainwire.h produce bit-identical results.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+static inline int ref_rice_read(uint8_t *bytes, int *bit_pos, uint32_t k) {
+	int msbs = 0;
+	int p = *bit_pos;
+	while (!(bytes[p >> 3] & (1 << (7-(p & 7))))) {
+		p++;
+		msbs++;
+	}
+	p++;
+
+	int count = k;
+	int lsbs = 0;
+	while (count) {
+		int remaining = 8 - (p & 7);
+		int read = remaining < count ? remaining : count;
+		int shift = remaining - read;
+		int mask = (0xff >> (8 - read));
+		lsbs = (lsbs << read) | ((bytes[p >> 3] & (mask << shift)) >> shift);
+		p += read;
+		count -= read;
+	}
+	*bit_pos = p;
+
+	int val;
+	uint32_t uval = (msbs << k) | lsbs;
+	if (uval & 1) {
+		val = -((int)(uval >> 1)) - 1;
+	}
+	else {
+		val = (int)(uval >> 1);
+	}
+
+	return val;
+}
+
+static inline int ref_rice_write(uint8_t *bytes, int *bit_pos, int val, uint32_t k) {
+	uint32_t uval = val;
+	uval <<= 1;
+	uval ^= (val >> 31);
+
+	uint32_t msbs = uval >> k;
+	uint32_t lsbs = 1 + k;
+	uint32_t count = msbs + lsbs;
+	uint32_t pattern = 1 << k; // the unary end bit
+	pattern |= (uval & ((1 << k)-1)); // the binary LSBs
+
+	int pos = *bit_pos;
+	while (count) {
+		int occupied = (pos & 7);
+		int remaining = 8 - occupied;
+		int written = remaining < count ? remaining : count;
+		int bits = 0;
+		if (count - written < 31) {
+			bits = (pattern >> (count - written)) << (remaining - written);
+			bits &= (0xff >> occupied);
+		}
+		bytes[pos >> 3] |= bits;
+		pos += written;
+		count -= written;
+	}
+	*bit_pos = pos;
+	return msbs + lsbs;
+}
+
+static inline int ref_dequant(int v) {
+	if (v >= 0) {
+		return round(v * 64.061577 + 31.034184);
+	}
+	else {
+		return -round((-v -1) * 64.061577 + 31.034184) - 1;
+	}
+}
+
+static inline int ref_quant(int v) {
+	return (int)floor(v/64.0);
+}
+
+// The original v1 writer, into bytes, which has to be zeroed and hold at 
+// least samples * 2 + 8 bytes. Returns the length in bytes.
+static int ref_encode(short *sample_data, int samples, int samplerate, uint8_t *bytes) {
+	int bit_pos = 0;
+	float rice_k = 3;
+
+	ref_rice_write(bytes, &bit_pos, samples, 16);
+	ref_rice_write(bytes, &bit_pos, samplerate, 16);
+
+	int prev_quantized = 0;
+	for (int i = 0; i < samples; i++) {
+		int quantized = ref_quant(sample_data[i]);
+		int residual = quantized - prev_quantized;
+		prev_quantized = quantized;
+
+		int encoded_len = ref_rice_write(bytes, &bit_pos, residual, rice_k);
+		rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+	}
+	return (bit_pos + 7) / 8;
+}
+
+// The original v1 reader, into sample_data, which has to hold the number of 
+// samples in the stream. Returns the number of samples.
+static int ref_decode(uint8_t *bytes, short *sample_data) {
+	int bit_pos = 0;
+	float rice_k = 3;
+
+	int samples = ref_rice_read(bytes, &bit_pos, 16);
+	ref_rice_read(bytes, &bit_pos, 16); // samplerate
+
+	int prev_quantized = 0;
+	for (int i = 0; i < samples; i++) {
+		int temp = bit_pos;
+
+		int residual = ref_rice_read(bytes, &bit_pos, rice_k);
+		int quantized = prev_quantized + residual;
+		prev_quantized = quantized;
+		sample_data[i] = ref_dequant(quantized);
+
+		int encoded_len = bit_pos - temp;
+		rice_k = rice_k * 0.99 + (encoded_len / 1.55) * 0.01;
+	}
+	return samples;
+}
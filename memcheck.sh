@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+
+# Memory check: encodes and decodes synthetic files of two sizes in each
+# coding mode with `bwenc --mem-report` and fails if
+#  - writing a WAV allocates anything (it streams the samples to disk),
+#  - the peak heap use per input byte of any operation differs between the
+#    small and the large file by more than 2% (i.e. grows faster than the
+#    input), or
+#  - the peak heap use of reading a WAV or writing a .bw exceeds its budget
+#    in bytes per input byte, plus a constant allowance for fixed size
+#    buffers (e.g. the padding after a stream).
+#
+# Usage: ./memcheck.sh [path/to/bwenc]
+
+set -e
+
+# Bytes of peak heap use allowed on top of the per input byte budgets
+allowance=65536
+
+bwenc=${1:-./bwenc}
+cc=${CC:-gcc}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+$cc -std=c99 -O3 bwgen.c -lm -o "$work/bwgen"
+"$work/bwgen" -seed 1 -d 5 "$work/small.wav"
+"$work/bwgen" -seed 1 -d 40 "$work/large.wav"
+
+# Peak heap use in bytes per input byte of operation $2 in report $1
+peak() {
+  grep "^mem $2 " "$1" | sed -E 's/.*peak [0-9]+ bytes \(([0-9.]+).*/\1/'
+}
+
+peak_bytes() {
+  grep "^mem $2 " "$1" | sed -E 's/.*peak ([0-9]+) bytes.*/\1/'
+}
+
+allocated() {
+  grep "^mem $2 " "$1" | sed -E 's/.*allocated ([0-9]+) bytes.*/\1/'
+}
+
+failed=0
+check() {
+  if ! awk "BEGIN { exit !($2) }"; then
+    echo "ERROR: $1"
+    failed=1
+  fi
+}
+
+# mode name, budget for writing the .bw in bytes per input byte, bwenc options
+while IFS='|' read -r name budget opts; do
+  for size in small large; do
+    $bwenc --mem-report $opts "$work/$size.wav" "$work/$size.bw" > "$work/$name-$size-enc.txt"
+    $bwenc --mem-report "$work/$size.bw" "$work/$size.out.wav" > "$work/$name-$size-dec.txt"
+    cmp -s "$work/$size.wav" "$work/$size.out.wav" || { echo "ERROR: $name: round trip failed"; failed=1; }
+  done
+
+  for size in small large; do
+    enc="$work/$name-$size-enc.txt"
+    dec="$work/$name-$size-dec.txt"
+    wav_bytes=$(wc -c < "$work/$size.wav")
+    check "$name: reading the $size WAV exceeds 1 byte/input byte" \
+      "$(peak_bytes "$enc" read) <= $wav_bytes + $allowance"
+    check "$name: writing the $size .bw exceeds $budget bytes/input byte" \
+      "$(peak_bytes "$enc" write) <= $budget * ($wav_bytes - 44) + $allowance"
+    check "$name: writing the $size WAV allocates memory" "$(allocated "$dec" write) == 0"
+  done
+
+  for op in enc:read enc:write dec:read; do
+    s=$(peak "$work/$name-small-${op%:*}.txt" "${op#*:}")
+    l=$(peak "$work/$name-large-${op%:*}.txt" "${op#*:}")
+    echo "$name ${op%:*} ${op#*:}: ${s} bytes/input byte (small), ${l} (large)"
+    check "$name ${op%:*} ${op#*:}: peak per input byte grows with the input size" "$l <= $s * 1.02"
+  done
+done <<EOF
+rice|1|
+hum|1|-n 50
+wavelet|4|-w
+spikes|1|-s
+turbo|1|--turbo
+EOF
+
+exit $failed
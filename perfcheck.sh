@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+
+# Performance regression check: builds bwbench against the codec (bwenc.c,
+# brainwire.h) of the working tree and of a baseline git revision, runs the
+# corpus benchmark on both (interleaved, pinned to one CPU) and fails if the
+# median encode or decode throughput of the current tree is more than
+# THRESHOLD percent below the baseline's.
+#
+# Usage: ./perfcheck.sh [baseline-rev] [threshold-percent] [files.wav...]
+#
+# Defaults: HEAD, 5%, and a synthetic corpus from bwgen. Environment:
+#   PERF_RUNS  number of benchmark runs per build (default 11)
+#   PERF_CPU   CPU to pin to (default: the last online CPU)
+#   CC, CFLAGS compiler and flags (default gcc, -std=c99 -O3)
+#
+# bwbench.c of the working tree is used for both builds, so the baseline
+# needs the buffer API (brainwire_encode/brainwire_decode).
+
+set -e
+
+baseline=${1:-HEAD}
+threshold=${2:-5}
+shift 2 2>/dev/null || shift $#
+runs=${PERF_RUNS:-11}
+cpu=${PERF_CPU:-$(($(nproc) - 1))}
+cc=${CC:-gcc}
+cflags=${CFLAGS:--std=c99 -O3}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/current" "$work/baseline"
+cp bwbench.c bwenc.c brainwire.h "$work/current/"
+cp bwbench.c "$work/baseline/"
+git show "${baseline}:bwenc.c" > "$work/baseline/bwenc.c"
+if git cat-file -e "${baseline}:brainwire.h" 2> /dev/null; then
+  git show "${baseline}:brainwire.h" > "$work/baseline/brainwire.h"
+fi
+
+for build in current baseline; do
+  $cc $cflags "$work/$build/bwbench.c" -lm -o "$work/$build/bwbench"
+done
+
+files=("$@")
+if [ ${#files[@]} -eq 0 ]; then
+  $cc -std=c99 -O3 bwgen.c -lm -o "$work/bwgen"
+  for seed in 1 2 3 4; do
+    "$work/bwgen" -seed $seed -d 30 "$work/synth$seed.wav"
+    files+=("$work/synth$seed.wav")
+  done
+fi
+
+pin=""
+if command -v taskset > /dev/null && taskset -c "$cpu" true 2> /dev/null; then
+  pin="taskset -c $cpu"
+else
+  echo "Not pinning to CPU $cpu (taskset not available or CPU not allowed)"
+fi
+
+# Interleave the runs, so that drift (thermal, other load) affects both alike
+for ((i = 0; i < runs; i++)); do
+  for build in current baseline; do
+    $pin "$work/$build/bwbench" "${files[@]}" | grep '"total"' \
+      | sed -E 's/.*"encode_mb_s": ([0-9.]+), "decode_mb_s": ([0-9.]+).*/\1 \2/' \
+      >> "$work/$build.txt"
+  done
+done
+
+# Median of stdin, one value per line
+median() {
+  sort -n | awk '{ v[NR] = $1 } END {
+    printf "%.2f", (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+  }'
+}
+
+# Median and median absolute deviation of column $1 in file $2
+stats() {
+  local med mad
+  med=$(cut -d' ' -f"$1" "$2" | median)
+  mad=$(cut -d' ' -f"$1" "$2" | awk -v m="$med" '{ d = $1 - m; print d < 0 ? -d : d }' | median)
+  echo "$med $mad"
+}
+
+failed=0
+echo "Baseline: ${baseline}, threshold: ${threshold}%, runs: ${runs}"
+for col in 1 2; do
+  name=$([ $col -eq 1 ] && echo encode || echo decode)
+  read -r cur_med cur_mad <<< "$(stats $col "$work/current.txt")"
+  read -r base_med base_mad <<< "$(stats $col "$work/baseline.txt")"
+  change=$(awk -v c="$cur_med" -v b="$base_med" 'BEGIN { printf "%.2f", (c - b) / b * 100 }')
+  echo "${name}: current ${cur_med} MB/s (±${cur_mad}), baseline ${base_med} MB/s (±${base_mad}), change ${change}%"
+
+  if awk -v ch="$change" -v t="$threshold" 'BEGIN { exit !(ch < -t) }'; then
+    echo "ERROR: ${name} throughput regressed by more than ${threshold}%"
+    failed=1
+  fi
+done
+
+exit $failed
@@ -0,0 +1,106 @@
+#!/usr/bin/env bash
+
+# Profile guided build: trains instrumented builds on a corpus, writes a
+# PGO+LTO optimized bwenc to ./bwenc-pgo and reports the encode and decode
+# throughput of bwbench built plain (CFLAGS), with LTO, with PGO and with
+# PGO+LTO.
+#
+# Usage: ./pgo.sh [files.wav...]
+#
+# Training runs encode and decode every file in each coding mode. Without
+# files, it trains on a synthetic corpus from bwgen (seeds 1-2) and measures
+# on a different one (seeds 3-4); given files are used for both. Environment:
+#   PGO_RUNS   number of benchmark runs per build (default 5)
+#   CC, CFLAGS compiler and flags (default gcc, -std=c99 -O3)
+
+set -e
+
+runs=${PGO_RUNS:-5}
+cc=${CC:-gcc}
+cflags=${CFLAGS:--std=c99 -O3}
+modes=("" "-n 50" "-w" "-s")
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+train=("$@")
+measure=("$@")
+if [ ${#train[@]} -eq 0 ]; then
+  $cc -std=c99 -O3 bwgen.c -lm -o "$work/bwgen"
+  for seed in 1 2 3 4; do
+    "$work/bwgen" -seed $seed -d 30 "$work/synth$seed.wav"
+  done
+  train=("$work/synth1.wav" "$work/synth2.wav")
+  measure=("$work/synth3.wav" "$work/synth4.wav")
+fi
+
+# Builds $1.c into $work/$2 with the extra flags $3. Compiling and linking
+# separately keeps the object path, which names the profile, the same for
+# -fprofile-generate and -fprofile-use.
+build() {
+  $cc $cflags $3 -c "$1.c" -o "$work/$2.o"
+  $cc $cflags $3 "$work/$2.o" -lm -o "$work/$2"
+}
+
+# Instrumentation and profile use flags for profile $1
+gen() {
+  echo "-fprofile-generate=$work/profile-$1 -fprofile-update=single"
+}
+use() {
+  echo "-fprofile-use=$work/profile-$1 -fprofile-correction -Wno-missing-profile"
+}
+
+# Trains the instrumented bwbench $1 on the corpus in each mode
+train_bwbench() {
+  for mode in "${modes[@]}"; do
+    "$work/$1" $mode "${train[@]}" > /dev/null
+  done
+}
+
+build bwbench bwbench-plain ""
+build bwbench bwbench-lto "-flto"
+
+build bwbench bwbench-pgo "$(gen pgo)"
+train_bwbench bwbench-pgo
+build bwbench bwbench-pgo "$(use pgo)"
+
+build bwbench bwbench-pgo-lto "$(gen pgo-lto) -flto"
+train_bwbench bwbench-pgo-lto
+build bwbench bwbench-pgo-lto "$(use pgo-lto) -flto"
+
+build bwenc bwenc "$(gen bwenc) -flto"
+for mode in "${modes[@]}"; do
+  for file in "${train[@]}"; do
+    "$work/bwenc" $mode "$file" "$work/train.bw" > /dev/null
+    "$work/bwenc" "$work/train.bw" "$work/train.wav" > /dev/null
+  done
+done
+build bwenc bwenc "$(use bwenc) -flto"
+cp "$work/bwenc" bwenc-pgo
+
+# Median of stdin, one value per line
+median() {
+  sort -n | awk '{ v[NR] = $1 } END {
+    printf "%.2f", (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+  }'
+}
+
+builds=(plain lto pgo pgo-lto)
+for ((i = 0; i < runs; i++)); do
+  for build in "${builds[@]}"; do
+    "$work/bwbench-$build" "${measure[@]}" | grep '"total"' \
+      | sed -E 's/.*"encode_mb_s": ([0-9.]+), "decode_mb_s": ([0-9.]+).*/\1 \2/' \
+      >> "$work/$build.txt"
+  done
+done
+
+echo "Wrote bwenc-pgo. Median of ${runs} runs, speedup relative to plain (${cflags}):"
+printf "%-8s %12s %8s %12s %8s\n" build "encode MB/s" "" "decode MB/s" ""
+read -r plain_enc plain_dec <<< "$(cut -d' ' -f1 "$work/plain.txt" | median) $(cut -d' ' -f2 "$work/plain.txt" | median)"
+for build in "${builds[@]}"; do
+  enc=$(cut -d' ' -f1 "$work/$build.txt" | median)
+  dec=$(cut -d' ' -f2 "$work/$build.txt" | median)
+  awk -v n="$build" -v e="$enc" -v d="$dec" -v pe="$plain_enc" -v pd="$plain_dec" 'BEGIN {
+    printf "%-8s %12.2f %+7.1f%% %12.2f %+7.1f%%\n", n, e, (e / pe - 1) * 100, d, (d / pd - 1) * 100
+  }'
+done
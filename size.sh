@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+
+# Size profile: builds the decoder only bwdec for size and reports its text
+# and file size and its decode throughput next to the full bwenc.
+#
+# Usage: ./size.sh [files.bw...]
+#
+# Without files, it decodes a 300s synthetic recording from bwgen, encoded
+# by bwenc. The throughput is that of the whole process, including reading
+# the .bw and writing the WAV, over the median of SIZE_RUNS runs (default 5).
+# Environment:
+#   CC, CFLAGS     compiler and flags of the full build (default gcc, 
+#                  -std=c99 -O3)
+#   SIZE_CFLAGS    flags of the size build (default: see below)
+
+set -e
+
+runs=${SIZE_RUNS:-5}
+cc=${CC:-gcc}
+cflags=${CFLAGS:--std=c99 -O3}
+size_cflags=${SIZE_CFLAGS:--std=c99 -Os -flto -ffunction-sections -fdata-sections \
+-fno-asynchronous-unwind-tables -Wl,--gc-sections -Wl,-z,noseparate-code \
+-Wl,--build-id=none -Wl,-z,norelro -s}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+$cc $cflags bwenc.c -lm -pthread -o "$work/bwenc"
+$cc $size_cflags bwdec.c -o "$work/bwdec"
+
+files=("$@")
+if [ ${#files[@]} -eq 0 ]; then
+  $cc -std=c99 -O3 bwgen.c -lm -o "$work/bwgen"
+  "$work/bwgen" -seed 3 -d 300 "$work/synth.wav"
+  "$work/bwenc" "$work/synth.wav" "$work/synth.bw" > /dev/null
+  files=("$work/synth.bw")
+fi
+
+# Median of stdin, one value per line
+median() {
+  sort -n | awk '{ v[NR] = $1 } END {
+    printf "%.2f", (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+  }'
+}
+
+# Decodes all files with the tool $1 and prints the throughput in MB/s of
+# decoded samples. Checks that the output matches bwenc's.
+decode_mb_s() {
+  local bytes=0 start end
+  start=$(date +%s%N)
+  for file in "${files[@]}"; do
+    "$work/$1" "$file" "$work/out-$1.wav" > /dev/null
+    bytes=$((bytes + $(stat -c %s "$work/out-$1.wav") - 44))
+  done
+  end=$(date +%s%N)
+  awk -v b=$bytes -v ns=$((end - start)) 'BEGIN { printf "%.2f\n", b / 1048576 / (ns / 1e9) }'
+}
+
+for file in "${files[@]}"; do
+  "$work/bwenc" "$file" "$work/ref.wav" > /dev/null
+  "$work/bwdec" "$file" "$work/dec.wav"
+  cmp -s "$work/ref.wav" "$work/dec.wav" || { echo "bwdec output differs for $file"; exit 1; }
+done
+
+tools=(bwenc bwdec)
+for ((i = 0; i < runs; i++)); do
+  for tool in "${tools[@]}"; do
+    decode_mb_s $tool >> "$work/$tool.txt"
+  done
+done
+
+echo "Median of ${runs} runs; bwenc: ${cflags}, bwdec: ${size_cflags}"
+printf "%-8s %10s %10s %12s %10s\n" tool "text" "file" "decode MB/s" "libm"
+for tool in "${tools[@]}"; do
+  text=$(size "$work/$tool" | awk 'NR == 2 { print $1 }')
+  file=$(stat -c %s "$work/$tool")
+  libm=$( (ldd "$work/$tool" 2>/dev/null | grep -q libm) && echo yes || echo no)
+  printf "%-8s %10d %10d %12.2f %10s\n" $tool $text $file "$(median < "$work/$tool.txt")" $libm
+done